@@ -29,7 +29,7 @@ local void ACPIValidateRSDP(acpi_rsdp* RSDP)
         }
 
         acpi_description_header* RSDT = (acpi_description_header*)
-            (usize)(RSDP->AddressOfRSDT);
+            PhysicalToVirtual(RSDP->AddressOfRSDT);
 
         if (!ACPIIsChecksumValid(RSDT, RSDT->Length))
         {
@@ -48,7 +48,7 @@ local void ACPIValidateRSDP(acpi_rsdp* RSDP)
         }
 
         acpi_description_header* XSDT = (acpi_description_header*)
-            (usize)(RSDP->AddressOfXSDT);
+            PhysicalToVirtual(RSDP->AddressOfXSDT);
 
         if (!ACPIIsChecksumValid(XSDT, XSDT->Length))
         {
@@ -71,7 +71,7 @@ local usize ACPIGetTableCount(acpi_rsdp* RSDP)
         // NOTE(vak): ACPI 1.0
 
         acpi_description_header* RSDT = (acpi_description_header*)
-            (usize)(RSDP->AddressOfRSDT);
+            PhysicalToVirtual(RSDP->AddressOfRSDT);
 
         Result = (RSDT->Length - sizeof(acpi_description_header)) / sizeof(u32);
     }
@@ -80,7 +80,7 @@ local usize ACPIGetTableCount(acpi_rsdp* RSDP)
         // NOTE(vak): ACPI 2.0 and above
 
         acpi_description_header* XSDT = (acpi_description_header*)
-            (usize)(RSDP->AddressOfXSDT);
+            PhysicalToVirtual(RSDP->AddressOfXSDT);
 
         Result = (XSDT->Length - sizeof(acpi_description_header)) / sizeof(u64);
     }
@@ -98,7 +98,7 @@ local acpi_description_header* ACPIGetTableAddress(acpi_rsdp* RSDP, usize Index)
         // NOTE(vak): ACPI 1.0
 
         acpi_description_header* RSDT = (acpi_description_header*)
-            (usize)(RSDP->AddressOfRSDT);
+            PhysicalToVirtual(RSDP->AddressOfRSDT);
 
         usize EntryCount = (RSDT->Length - sizeof(acpi_description_header)) / sizeof(u32);
         u32* Entries = (u32*)(RSDT + 1);
@@ -113,7 +113,7 @@ local acpi_description_header* ACPIGetTableAddress(acpi_rsdp* RSDP, usize Index)
         // NOTE(vak): ACPI 2.0 and above
 
         acpi_description_header* XSDT = (acpi_description_header*)
-            (usize)(RSDP->AddressOfXSDT);
+            PhysicalToVirtual(RSDP->AddressOfXSDT);
 
         usize EntryCount = (XSDT->Length - sizeof(acpi_description_header)) / sizeof(u64);
         u64* Entries = (u64*)(XSDT + 1);
@@ -124,7 +124,7 @@ local acpi_description_header* ACPIGetTableAddress(acpi_rsdp* RSDP, usize Index)
         }
     }
 
-    return (acpi_description_header*)(Result);
+    return (acpi_description_header*)(Result ? PhysicalToVirtual(Result) : 0);
 }
 
 local acpi_description_header* ACPIFindTableAddress(acpi_rsdp* RSDP, u32 Signature)
@@ -137,7 +137,7 @@ local acpi_description_header* ACPIFindTableAddress(acpi_rsdp* RSDP, u32 Signatu
         // NOTE(vak): ACPI 1.0
 
         acpi_description_header* RSDT = (acpi_description_header*)
-            (usize)(RSDP->AddressOfRSDT);
+            PhysicalToVirtual(RSDP->AddressOfRSDT);
 
         usize EntryCount = (RSDT->Length - sizeof(acpi_description_header)) / sizeof(u32);
         u32* Entries = (u32*)(RSDT + 1);
@@ -145,7 +145,7 @@ local acpi_description_header* ACPIFindTableAddress(acpi_rsdp* RSDP, u32 Signatu
         for (usize Index = 0; Index < EntryCount; Index++)
         {
             acpi_description_header* Table = (acpi_description_header*)
-                (usize)(Entries[Index]);
+                PhysicalToVirtual(Entries[Index]);
 
             if (Table->Signature == Signature)
             {
@@ -159,7 +159,7 @@ local acpi_description_header* ACPIFindTableAddress(acpi_rsdp* RSDP, u32 Signatu
         // NOTE(vak): ACPI 2.0 and above
 
         acpi_description_header* XSDT = (acpi_description_header*)
-            (usize)(RSDP->AddressOfXSDT);
+            PhysicalToVirtual(RSDP->AddressOfXSDT);
 
         usize EntryCount = (XSDT->Length - sizeof(acpi_description_header)) / sizeof(u64);
         u64* Entries = (u64*)(XSDT + 1);
@@ -167,7 +167,7 @@ local acpi_description_header* ACPIFindTableAddress(acpi_rsdp* RSDP, u32 Signatu
         for (usize Index = 0; Index < EntryCount; Index++)
         {
             acpi_description_header* Table = (acpi_description_header*)
-                (usize)(Entries[Index]);
+                PhysicalToVirtual(Entries[Index]);
 
             if (Table->Signature == Signature)
             {
@@ -177,5 +177,231 @@ local acpi_description_header* ACPIFindTableAddress(acpi_rsdp* RSDP, u32 Signatu
         }
     }
 
-    return (acpi_description_header*)(Result);
+    return (acpi_description_header*)(Result ? PhysicalToVirtual(Result) : 0);
+}
+
+local usize ACPIGetMCFGCount(acpi_mcfg* MCFG)
+{
+    usize Result = (MCFG->Header.Length - sizeof(acpi_mcfg)) / sizeof(acpi_mcfg_allocation);
+    return (Result);
+}
+
+local acpi_mcfg_allocation* ACPIGetMCFGAllocation(acpi_mcfg* MCFG, usize Index)
+{
+    acpi_mcfg_allocation* Result = 0;
+
+    if (Index < ACPIGetMCFGCount(MCFG))
+    {
+        Result = (acpi_mcfg_allocation*)(MCFG + 1) + Index;
+    }
+
+    return (Result);
+}
+
+local acpi_madt_entry* ACPIGetNextMADTEntry(acpi_madt* MADT, acpi_madt_entry* Entry)
+{
+    acpi_madt_entry* Result = 0;
+
+    usize Start = (usize)(MADT + 1);
+    usize End   = (usize)MADT + MADT->Header.Length;
+    usize Next  = (Entry) ? ((usize)Entry + Entry->Length) : Start;
+
+    // NOTE(vak): A zero length entry would loop forever, so it ends the
+    // table as well.
+
+    b32 Valid = (
+        (Next + sizeof(acpi_madt_entry) <= End) &&
+        (((acpi_madt_entry*)Next)->Length >= sizeof(acpi_madt_entry)) &&
+        (Next + ((acpi_madt_entry*)Next)->Length <= End)
+    );
+
+    if (Valid)
+    {
+        Result = (acpi_madt_entry*)Next;
+    }
+
+    return (Result);
+}
+
+local void ACPIParseMADT(acpi_madt* MADT, acpi_madt_info* Info)
+{
+    ZeroType(Info);
+
+    if (!ACPIIsChecksumValid(MADT, MADT->Header.Length))
+    {
+        SerialErrorf(Str("Checksum for ACPI MADT failed."));
+    }
+
+    Info->LocalAPICAddress = MADT->LocalAPICAddress;
+    Info->PCATCompatible   = (MADT->Flags & ACPI_MADT_PCATCompatible) != 0;
+
+    usize Dropped = 0;
+
+    for (acpi_madt_entry* Entry = ACPIGetNextMADTEntry(MADT, 0); Entry; Entry = ACPIGetNextMADTEntry(MADT, Entry))
+    {
+        switch (Entry->Type)
+        {
+            default: break;
+
+            case ACPI_MADTEntry_LocalAPIC:
+            {
+                acpi_madt_local_apic* LocalAPIC = (acpi_madt_local_apic*)Entry;
+
+                if (Info->LocalAPICCount < ACPIMaxLocalAPICCount)
+                {
+                    acpi_local_apic_info* Out = Info->LocalAPICs + Info->LocalAPICCount++;
+
+                    Out->ProcessorUID = LocalAPIC->ProcessorUID;
+                    Out->APICID       = LocalAPIC->APICID;
+                    Out->Enabled      = (LocalAPIC->Flags & ACPI_LocalAPIC_Enabled) != 0;
+                }
+                else
+                {
+                    Dropped++;
+                }
+            } break;
+
+            case ACPI_MADTEntry_LocalX2APIC:
+            {
+                acpi_madt_local_x2apic* LocalAPIC = (acpi_madt_local_x2apic*)Entry;
+
+                if (Info->LocalAPICCount < ACPIMaxLocalAPICCount)
+                {
+                    acpi_local_apic_info* Out = Info->LocalAPICs + Info->LocalAPICCount++;
+
+                    Out->ProcessorUID = LocalAPIC->ProcessorUID;
+                    Out->APICID       = LocalAPIC->X2APICID;
+                    Out->Enabled      = (LocalAPIC->Flags & ACPI_LocalAPIC_Enabled) != 0;
+                }
+                else
+                {
+                    Dropped++;
+                }
+            } break;
+
+            case ACPI_MADTEntry_IOAPIC:
+            {
+                acpi_madt_ioapic* IOAPIC = (acpi_madt_ioapic*)Entry;
+
+                if (Info->IOAPICCount < ACPIMaxIOAPICCount)
+                {
+                    acpi_ioapic_info* Out = Info->IOAPICs + Info->IOAPICCount++;
+
+                    Out->ID      = IOAPIC->IOAPICID;
+                    Out->Address = IOAPIC->Address;
+                    Out->GSIBase = IOAPIC->GSIBase;
+                }
+                else
+                {
+                    Dropped++;
+                }
+            } break;
+
+            case ACPI_MADTEntry_SourceOverride:
+            {
+                acpi_madt_source_override* Override = (acpi_madt_source_override*)Entry;
+
+                if (Info->OverrideCount < ACPIMaxOverrideCount)
+                {
+                    acpi_override_info* Out = Info->Overrides + Info->OverrideCount++;
+
+                    Out->Source = Override->Source;
+                    Out->GSI    = Override->GSI;
+                    Out->Flags  = Override->Flags;
+                }
+                else
+                {
+                    Dropped++;
+                }
+            } break;
+
+            case ACPI_MADTEntry_NMISource:
+            {
+                acpi_madt_nmi_source* Source = (acpi_madt_nmi_source*)Entry;
+
+                if (Info->NMISourceCount < ACPIMaxNMICount)
+                {
+                    acpi_nmi_info* Out = Info->NMISources + Info->NMISourceCount++;
+
+                    Out->Input = Source->GSI;
+                    Out->Flags = Source->Flags;
+                }
+                else
+                {
+                    Dropped++;
+                }
+            } break;
+
+            case ACPI_MADTEntry_LocalAPICNMI:
+            case ACPI_MADTEntry_LocalX2APICNMI:
+            {
+                if (Info->LocalNMICount < ACPIMaxNMICount)
+                {
+                    acpi_nmi_info* Out = Info->LocalNMIs + Info->LocalNMICount++;
+
+                    if (Entry->Type == ACPI_MADTEntry_LocalAPICNMI)
+                    {
+                        acpi_madt_local_apic_nmi* NMI = (acpi_madt_local_apic_nmi*)Entry;
+
+                        Out->ProcessorUID = (NMI->ProcessorUID == ACPI_AllProcessors) ? ACPI_AllProcessorsX2 : NMI->ProcessorUID;
+                        Out->Input        = NMI->LINT;
+                        Out->Flags        = NMI->Flags;
+                    }
+                    else
+                    {
+                        acpi_madt_local_x2apic_nmi* NMI = (acpi_madt_local_x2apic_nmi*)Entry;
+
+                        Out->ProcessorUID = NMI->ProcessorUID;
+                        Out->Input        = NMI->LINT;
+                        Out->Flags        = NMI->Flags;
+                    }
+                }
+                else
+                {
+                    Dropped++;
+                }
+            } break;
+
+            case ACPI_MADTEntry_LocalAPICOverride:
+            {
+                acpi_madt_local_apic_override* Override = (acpi_madt_local_apic_override*)Entry;
+                Info->LocalAPICAddress = Override->Address;
+            } break;
+        }
+    }
+
+    if (Dropped)
+    {
+        SerialErrorf(Str("Dropped %usize ACPI MADT entries past the limits."), Dropped);
+    }
+
+    SerialInfof(
+        Str("ACPI MADT: %usize local APICs, %usize IOAPICs, %usize overrides, %usize NMI sources, %usize local NMIs"),
+        Info->LocalAPICCount,
+        Info->IOAPICCount,
+        Info->OverrideCount,
+        Info->NMISourceCount,
+        Info->LocalNMICount
+    );
+}
+
+local u32 ACPIGetISAInterrupt(acpi_madt_info* Info, u32 IRQ, u16* Flags)
+{
+    u32 Result = IRQ;
+
+    *Flags = 0;
+
+    for (usize Index = 0; Index < Info->OverrideCount; Index++)
+    {
+        acpi_override_info* Override = Info->Overrides + Index;
+
+        if (Override->Source == IRQ)
+        {
+            Result = Override->GSI;
+            *Flags = Override->Flags;
+            break;
+        }
+    }
+
+    return (Result);
 }
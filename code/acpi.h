@@ -34,8 +34,233 @@ packed(typedef struct
 
 CTAssert(sizeof(acpi_description_header) == 36);
 
+// NOTE(vak): PCI Express memory mapped configuration space (MCFG)
+
+packed(typedef struct
+{
+    u64 BaseAddress;
+    u16 SegmentGroup;
+    u8  StartBus;
+    u8  EndBus;
+    u32 Reserved;
+} acpi_mcfg_allocation)
+
+CTAssert(sizeof(acpi_mcfg_allocation) == 16);
+
+packed(typedef struct
+{
+    acpi_description_header Header;
+    u64                     Reserved;
+
+    // NOTE(vak): Followed by acpi_mcfg_allocation entries
+} acpi_mcfg)
+
+CTAssert(sizeof(acpi_mcfg) == 44);
+
+// NOTE(vak): Multiple APIC description table (MADT)
+//
+// Lists the interrupt controllers of the machine: a local APIC for
+// every processor, the IOAPICs with the range of global system
+// interrupts (GSIs) each of them handles, how legacy ISA interrupts map
+// onto GSIs where they don't map one to one, and which inputs carry
+// NMIs. Entries are variable length records that follow the table.
+
+packed(typedef struct
+{
+    acpi_description_header Header;
+    u32                     LocalAPICAddress;
+    u32                     Flags;
+
+    // NOTE(vak): Followed by acpi_madt_entry records
+} acpi_madt)
+
+CTAssert(sizeof(acpi_madt) == 44);
+
+#define ACPI_MADT_PCATCompatible (1 << 0) // NOTE(vak): Legacy PICs are present
+
+typedef usize acpi_madt_entry_type;
+enum
+{
+    ACPI_MADTEntry_LocalAPIC         = 0,
+    ACPI_MADTEntry_IOAPIC            = 1,
+    ACPI_MADTEntry_SourceOverride    = 2,
+    ACPI_MADTEntry_NMISource         = 3,
+    ACPI_MADTEntry_LocalAPICNMI      = 4,
+    ACPI_MADTEntry_LocalAPICOverride = 5,
+    ACPI_MADTEntry_LocalX2APIC       = 9,
+    ACPI_MADTEntry_LocalX2APICNMI    = 10,
+};
+
+packed(typedef struct
+{
+    u8 Type;
+    u8 Length;
+} acpi_madt_entry)
+
+packed(typedef struct
+{
+    acpi_madt_entry Header;
+    u8              ProcessorUID;
+    u8              APICID;
+    u32             Flags;
+} acpi_madt_local_apic)
+
+packed(typedef struct
+{
+    acpi_madt_entry Header;
+    u8              IOAPICID;
+    u8              Reserved;
+    u32             Address;
+    u32             GSIBase;
+} acpi_madt_ioapic)
+
+packed(typedef struct
+{
+    acpi_madt_entry Header;
+    u8              Bus;
+    u8              Source;
+    u32             GSI;
+    u16             Flags;
+} acpi_madt_source_override)
+
+packed(typedef struct
+{
+    acpi_madt_entry Header;
+    u16             Flags;
+    u32             GSI;
+} acpi_madt_nmi_source)
+
+packed(typedef struct
+{
+    acpi_madt_entry Header;
+    u8              ProcessorUID;
+    u16             Flags;
+    u8              LINT;
+} acpi_madt_local_apic_nmi)
+
+packed(typedef struct
+{
+    acpi_madt_entry Header;
+    u16             Reserved;
+    u64             Address;
+} acpi_madt_local_apic_override)
+
+packed(typedef struct
+{
+    acpi_madt_entry Header;
+    u16             Reserved;
+    u32             X2APICID;
+    u32             Flags;
+    u32             ProcessorUID;
+} acpi_madt_local_x2apic)
+
+packed(typedef struct
+{
+    acpi_madt_entry Header;
+    u16             Flags;
+    u32             ProcessorUID;
+    u8              LINT;
+    u8              Reserved[3];
+} acpi_madt_local_x2apic_nmi)
+
+CTAssert(sizeof(acpi_madt_local_apic)          == 8);
+CTAssert(sizeof(acpi_madt_ioapic)              == 12);
+CTAssert(sizeof(acpi_madt_source_override)     == 10);
+CTAssert(sizeof(acpi_madt_nmi_source)          == 8);
+CTAssert(sizeof(acpi_madt_local_apic_nmi)      == 6);
+CTAssert(sizeof(acpi_madt_local_apic_override) == 12);
+CTAssert(sizeof(acpi_madt_local_x2apic)        == 16);
+CTAssert(sizeof(acpi_madt_local_x2apic_nmi)    == 12);
+
+#define ACPI_LocalAPIC_Enabled       (1 << 0)
+#define ACPI_LocalAPIC_OnlineCapable (1 << 1)
+
+#define ACPI_AllProcessors   (0xFF)       // NOTE(vak): Processor UID of a local APIC NMI
+#define ACPI_AllProcessorsX2 (0xFFFFFFFF)
+
+// NOTE(vak): Interrupt flags (MPS INTI), 0 means the bus default,
+// which for ISA is active high and edge triggered.
+
+#define ACPI_INTI_PolarityMask (0x3)
+#define ACPI_INTI_ActiveHigh   (0x1)
+#define ACPI_INTI_ActiveLow    (0x3)
+#define ACPI_INTI_TriggerMask  (0xC)
+#define ACPI_INTI_Edge         (0x4)
+#define ACPI_INTI_Level        (0xC)
+
+// NOTE(vak): The parsed MADT, with the entries sorted by kind. Entries
+// past the limits are dropped with an error.
+
+#define ACPIMaxLocalAPICCount (256)
+#define ACPIMaxIOAPICCount    (16)
+#define ACPIMaxOverrideCount  (16)
+#define ACPIMaxNMICount       (16)
+
+typedef struct
+{
+    u32 ProcessorUID;
+    u32 APICID;
+    b32 Enabled;
+} acpi_local_apic_info;
+
+typedef struct
+{
+    u32 ID;
+    u64 Address;
+    u32 GSIBase;
+} acpi_ioapic_info;
+
+typedef struct
+{
+    u32 Source; // NOTE(vak): ISA IRQ
+    u32 GSI;
+    u16 Flags;
+} acpi_override_info;
+
+typedef struct
+{
+    u32 ProcessorUID; // NOTE(vak): Local APIC NMIs only
+    u32 Input;        // NOTE(vak): GSI of an NMI source, or LINT pin of a local APIC NMI
+    u16 Flags;
+} acpi_nmi_info;
+
+typedef struct
+{
+    u64                  LocalAPICAddress;
+    b32                  PCATCompatible;
+
+    usize                LocalAPICCount;
+    acpi_local_apic_info LocalAPICs[ACPIMaxLocalAPICCount];
+
+    usize                IOAPICCount;
+    acpi_ioapic_info     IOAPICs[ACPIMaxIOAPICCount];
+
+    usize                OverrideCount;
+    acpi_override_info   Overrides[ACPIMaxOverrideCount];
+
+    usize                NMISourceCount;
+    acpi_nmi_info        NMISources[ACPIMaxNMICount];
+
+    usize                LocalNMICount;
+    acpi_nmi_info        LocalNMIs[ACPIMaxNMICount];
+} acpi_madt_info;
+
 local void ACPIValidateRSDP(acpi_rsdp* RSDP);
 
 local usize ACPIGetTableCount(acpi_rsdp* RSDP);
 local acpi_description_header* ACPIGetTableAddress(acpi_rsdp* RSDP, usize Index);
 local acpi_description_header* ACPIFindTableAddress(acpi_rsdp* RSDP, u32 Signature);
+
+local usize ACPIGetMCFGCount(acpi_mcfg* MCFG);
+local acpi_mcfg_allocation* ACPIGetMCFGAllocation(acpi_mcfg* MCFG, usize Index);
+
+// NOTE(vak): Returns the entry after Entry, or the first one if Entry
+// is 0. Returns 0 past the last entry.
+
+local acpi_madt_entry* ACPIGetNextMADTEntry(acpi_madt* MADT, acpi_madt_entry* Entry);
+local void             ACPIParseMADT(acpi_madt* MADT, acpi_madt_info* Info);
+
+// NOTE(vak): Maps a legacy ISA IRQ to its GSI, along with its INTI
+// flags, which are 0 unless it is overridden.
+
+local u32 ACPIGetISAInterrupt(acpi_madt_info* Info, u32 IRQ, u16* Flags);
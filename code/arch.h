@@ -3,19 +3,223 @@
 
 typedef struct arch_page_map arch_page_map;
 
+typedef usize arch_map_flags;
+enum
+{
+    ArchMapFlag_Write          = (1 << 0),
+    ArchMapFlag_User           = (1 << 1),
+    ArchMapFlag_Execute        = (1 << 5),
+
+    // NOTE(vak): Global mappings are shared by all address spaces and
+    // survive switching between them, meant for kernel memory.
+
+    ArchMapFlag_Global         = (1 << 6),
+
+    // NOTE(vak): Cache types, write-back is used when none is set.
+    // If more than one is set, the most restrictive one wins.
+
+    ArchMapFlag_WriteThrough   = (1 << 2),
+    ArchMapFlag_WriteCombining = (1 << 3),
+    ArchMapFlag_Uncached       = (1 << 4),
+};
+
+typedef usize arch_fault_flags;
+enum
+{
+    ArchFaultFlag_Present = (1 << 0), // NOTE(vak): The page was mapped, but the access wasn't allowed
+    ArchFaultFlag_Write   = (1 << 1),
+    ArchFaultFlag_User    = (1 << 2),
+    ArchFaultFlag_Execute = (1 << 3),
+};
+
+// NOTE(vak): Detects what the processor supports and picks the paging
+// mode. Called by the bootloader before anything is mapped, while the
+// firmware still owns the machine.
+
+local void ArchDetectFeatures(void);
 local void ArchSetup(void);
 
+// NOTE(vak): Gives the current processor separate stacks for the
+// interrupts that can't trust the stack they arrive on. Needs the
+// kernel arena.
+
+local void ArchSetupInterruptStacks(void);
+
 local void ArchWriteSerial(void* Buffer, usize Size);
 
+// NOTE(vak): Processors are numbered from 0 to ArchMaxCPUCount - 1.
+
+#define ArchMaxCPUCount (64)
+
+local usize ArchGetCPUIndex(void);
+
+// NOTE(vak): Returns whether interrupts were enabled, to be passed on
+// to ArchRestoreInterrupts.
+
+local b32  ArchDisableInterrupts(void);
+local void ArchRestoreInterrupts(b32 Enabled);
+
+// NOTE(vak): Interrupt handlers
+//
+// Every vector has a handler, along with a context pointer that is
+// passed back to it, so dispatching an interrupt is a single indirect
+// call. Vectors without a registered handler go to a default one, which
+// reports processor exceptions and unexpected interrupts. Handlers run
+// with interrupts disabled, processor exceptions included.
+
+#define ArchInterruptVectorCount (256)
+
+typedef struct arch_interrupt_frame arch_interrupt_frame;
+
+typedef void arch_interrupt_handler(arch_interrupt_frame* Frame, void* Context);
+
+// NOTE(vak): Fails if the vector already has a handler. Allocating a
+// vector picks a free one outside the processor exceptions, and
+// returns 0 if there is none left.
+
+local b32   ArchSetInterruptHandler(usize Vector, arch_interrupt_handler* Handler, void* Context);
+local void  ArchClearInterruptHandler(usize Vector);
+local usize ArchAllocateInterruptVector(arch_interrupt_handler* Handler, void* Context);
+
+local usize ArchGetInterruptVector(arch_interrupt_frame* Frame);
+
+// NOTE(vak): Sets up the current processor's interrupt controller. The
+// legacy controllers are disabled by ArchSetup, so no device interrupts
+// arrive until this is done. Needs the direct map.
+
+local void ArchSetupInterruptController(void);
+
+// NOTE(vak): Handlers of device interrupts and interprocessor interrupts
+// have to signal the end of the interrupt before they return, after
+// which the same vector can arrive again.
+
+local void ArchEndOfInterrupt(void);
+
+// NOTE(vak): Interrupts with a priority class (vector / 16) at or below
+// Priority are held back. 0 lets every interrupt through.
+
+local void ArchSetInterruptPriority(usize Priority);
+
+// NOTE(vak): Processors are addressed by the ID of their interrupt
+// controller, which isn't necessarily their index.
+
+local u32  ArchGetInterruptControllerID(void);
+local void ArchSendInterrupt(u32 TargetID, usize Vector);
+
+// NOTE(vak): Device interrupt routing
+//
+// Device interrupts are numbered by global system interrupt (GSI), as
+// described by the ACPI MADT. Each one can be steered to a vector on any
+// processor, ideally the one that handles the device's data. All of
+// them start out masked. Legacy ISA IRQs are routed by IRQ number, which
+// takes the overrides of the MADT into account.
+
+typedef usize arch_interrupt_flags;
+enum
+{
+    ArchInterruptFlag_ActiveLow = (1 << 0), // NOTE(vak): Active high when not set
+    ArchInterruptFlag_Level     = (1 << 1), // NOTE(vak): Edge triggered when not set
+};
+
+local void ArchSetupInterruptRouting(acpi_madt_info* MADT);
+
+local b32  ArchRouteInterrupt(u32 GSI, usize Vector, u32 TargetID, arch_interrupt_flags Flags);
+local b32  ArchRouteISAInterrupt(u32 IRQ, usize Vector, u32 TargetID);
+local void ArchMaskInterrupt(u32 GSI);
+
+// NOTE(vak): Message signalled interrupts are raised by a device writing
+// Data to Address, which delivers Vector to the processor with the given
+// interrupt controller ID. Fails if the processor can't be addressed.
+
+local b32 ArchGetMessageInterrupt(u32 TargetID, usize Vector, u64* Address, u32* Data);
+
+// NOTE(vak): Sleeps until the next interrupt.
+
+local void ArchWaitForInterrupt(void);
+
+// NOTE(vak): Zeroes a page without pulling it into the caches, meant
+// for pages that aren't going to be used right away.
+
+local void ArchZeroPage(void* Page);
+
+// NOTE(vak): Writes back and evicts any cached lines of the range, for
+// memory whose mapping is about to stop being cached.
+
+local void ArchFlushCache(void* Address, usize Size);
+
 local usize ArchGetPageSize(void);
+local b32   ArchIsPageSizeSupported(usize PageSize);
+
+local usize ArchGetDirectMapBase(void);
+local usize ArchGetDirectMapSize(void);
+
+// NOTE(vak): Kernel virtual address space that is left to the kernel
+// arena, apart from the direct map.
+
+local usize ArchGetKernelArenaBase(void);
+local usize ArchGetKernelArenaSize(void);
+
+// NOTE(vak): Page tables are taken from the given physical range before
+// falling back to the frame allocator, so that page maps can be built
+// before the frame allocator exists. ArchGetPageTableBound returns how
+// many page tables mapping Size bytes can take at most, if physical and
+// virtual addresses are equally aligned. With LargePages, the range is
+// expected to be mapped with large pages where it can.
+
+local void  ArchSetPageTablePool(usize Address, usize Size);
+local usize ArchGetPageTableBound(usize Size, b32 LargePages);
+
+// NOTE(vak): New page maps share the kernel's mappings, which are only
+// ever changed through the kernel page map.
+
+local arch_page_map* ArchGetKernelPageMap(void);
+local arch_page_map* ArchNewPageMap(void);
 
-local arch_page_map* ArchNewPageMap(memory_map* MemoryMap);
+// NOTE(vak): Mapping fails if a page table can't be allocated, which
+// may leave part of the range mapped.
 
-local void ArchMapPage(
-    memory_map*    MemoryMap,
+local b32 ArchMapPage(
     arch_page_map* PageMap,
     usize          PhysicalAddress,
-    usize          VirtualAddress
+    usize          VirtualAddress,
+    usize          PageSize
+);
+
+// NOTE(vak): Maps a page aligned range, walking the page tables once
+// and picking the largest page size that fits at each step.
+
+local b32 ArchMapRange(
+    arch_page_map* PageMap,
+    usize          PhysicalAddress,
+    usize          VirtualAddress,
+    usize          Size,
+    arch_map_flags Flags
+);
+
+local void ArchUnmapPage(
+    arch_page_map* PageMap,
+    usize          VirtualAddress,
+    usize          PageSize
+);
+
+// NOTE(vak): Unmaps a page aligned range and releases the page tables
+// that end up empty. With ReleaseFrames, the frames that were mapped
+// are released back to the frame allocator as well, and the number of
+// pages released is returned.
+
+local usize ArchUnmapRange(
+    arch_page_map* PageMap,
+    usize          VirtualAddress,
+    usize          Size,
+    b32            ReleaseFrames
 );
 
 local void ArchUsePageMap(arch_page_map* PageMap);
+
+// NOTE(vak): Drops any cached translations of the given range.
+
+local void ArchInvalidateRange(
+    arch_page_map* PageMap,
+    usize          VirtualAddress,
+    usize          Size
+);
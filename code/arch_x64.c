@@ -21,11 +21,400 @@ local void x64OutByte(u16 Port, u8 Byte)
     );
 }
 
-local void x64InterruptDispatch(x64_interrupt_frame* Frame)
+local void x64Halt(void)
 {
-    // NOTE(vak): Retrieve interrupt number and error code
+    for (;;)
+    {
+        __asm volatile ("cli\nhlt\n");
+    }
+}
+
+local b32 ArchDisableInterrupts(void)
+{
+    u64 RFLAGS = 0;
+
+    __asm volatile
+    (
+        "pushfq\n"
+        "popq %0\n"
+        "cli\n"
+        : "=r"(RFLAGS) :: "memory"
+    );
+
+    b32 Result = (RFLAGS >> 9) & 1; // NOTE(vak): Interrupt flag
+    return (Result);
+}
+
+local void ArchRestoreInterrupts(b32 Enabled)
+{
+    if (Enabled)
+    {
+        __asm volatile ("sti" ::: "memory");
+    }
+}
+
+local void ArchWaitForInterrupt(void)
+{
+    __asm volatile ("hlt" ::: "memory");
+}
+
+local void ArchZeroPage(void* Page)
+{
+    u8*   Bytes = (u8*)Page;
+    usize Size  = ArchGetPageSize();
+
+    // NOTE(vak): Non-temporal stores are weakly ordered, so fence them
+    // before the page is handed to anyone else.
+
+    for (usize Offset = 0; Offset < Size; Offset += 64)
+    {
+        __asm volatile
+        (
+            "movnti %1,  0(%0)\n"
+            "movnti %1,  8(%0)\n"
+            "movnti %1, 16(%0)\n"
+            "movnti %1, 24(%0)\n"
+            "movnti %1, 32(%0)\n"
+            "movnti %1, 40(%0)\n"
+            "movnti %1, 48(%0)\n"
+            "movnti %1, 56(%0)\n"
+            :: "r"(Bytes + Offset), "r"((u64)(0)) : "memory"
+        );
+    }
+
+    __asm volatile ("sfence" ::: "memory");
+}
+
+local void ArchFlushCache(void* Address, usize Size)
+{
+    usize Line = (usize)Address & ~(usize)(63);
+    usize End  = (usize)Address + Size;
+
+    for (; Line < End; Line += 64)
+    {
+        __asm volatile ("clflush (%0)" :: "r"(Line) : "memory");
+    }
+
+    __asm volatile ("mfence" ::: "memory");
+}
+
+local usize ArchGetCPUIndex(void)
+{
+    // NOTE(vak): Only the boot processor runs for now.
+
+    return (0);
+}
+
+local x64_cpuid x64CPUID(u32 Leaf, u32 SubLeaf)
+{
+    x64_cpuid Result = {0};
+
+    __asm volatile
+    (
+        "cpuid\n"
+        : "=a"(Result.EAX), "=b"(Result.EBX), "=c"(Result.ECX), "=d"(Result.EDX)
+        : "a"(Leaf), "c"(SubLeaf)
+    );
+
+    return (Result);
+}
+
+local u64 x64ReadCR2(void)
+{
+    u64 Result = 0;
+
+    __asm volatile
+    (
+        "mov %%cr2, %0\n"
+        : "=r"(Result)
+    );
+
+    return (Result);
+}
+
+local u64 x64ReadCR3(void)
+{
+    u64 Result = 0;
+
+    __asm volatile
+    (
+        "mov %%cr3, %0\n"
+        : "=r"(Result)
+    );
+
+    return (Result);
+}
+
+local void x64WriteCR3(u64 Value)
+{
+    __asm volatile
+    (
+        "mov %0, %%cr3\n"
+        :: "r"(Value) : "memory"
+    );
+}
+
+local u64 x64ReadCR4(void)
+{
+    u64 Result = 0;
+
+    __asm volatile
+    (
+        "mov %%cr4, %0\n"
+        : "=r"(Result)
+    );
+
+    return (Result);
+}
+
+local void x64WriteCR4(u64 Value)
+{
+    __asm volatile
+    (
+        "mov %0, %%cr4\n"
+        :: "r"(Value) : "memory"
+    );
+}
+
+local u64 x64ReadMSR(u32 Index)
+{
+    u32 Low  = 0;
+    u32 High = 0;
+
+    __asm volatile
+    (
+        "rdmsr\n"
+        : "=a"(Low), "=d"(High) : "c"(Index)
+    );
+
+    u64 Result = ((u64)(High) << 32) | Low;
+    return (Result);
+}
+
+local void x64WriteMSR(u32 Index, u64 Value)
+{
+    u32 Low  = (u32)(Value);
+    u32 High = (u32)(Value >> 32);
+
+    __asm volatile
+    (
+        "wrmsr\n"
+        :: "c"(Index), "a"(Low), "d"(High) : "memory"
+    );
+}
+
+local void x64InvalidatePage(usize Address)
+{
+    __asm volatile
+    (
+        "invlpg (%0)\n"
+        :: "r"(Address) : "memory"
+    );
+}
+
+local void x64InvalidatePCID(u64 Type, u16 PCID, usize Address)
+{
+    x64_invpcid_descriptor Descriptor =
+    {
+        .PCID    = PCID,
+        .Address = Address,
+    };
+
+    __asm volatile
+    (
+        "invpcid %0, %1\n"
+        :: "m"(Descriptor), "r"(Type) : "memory"
+    );
+}
+
+local x64_features x64Features = {0};
+
+local void x64DetectFeatures(void)
+{
+    x64_features* Features = &x64Features;
+
+    u32 MaxLeaf         = x64CPUID(0x00000000, 0).EAX;
+    u32 MaxExtendedLeaf = x64CPUID(0x80000000, 0).EAX;
+
+    if (MaxLeaf >= 0x00000001)
+    {
+        x64_cpuid Basic = x64CPUID(0x00000001, 0);
 
-    persist string Names[32] =
+        Features->PCID = (Basic.ECX >> 17) & 1;
+        Features->PAT         = (Basic.EDX >> 16) & 1;
+        Features->GlobalPages = (Basic.EDX >> 13) & 1;
+        Features->APIC        = (Basic.EDX >>  9) & 1;
+        Features->X2APIC      = (Basic.ECX >> 21) & 1;
+    }
+
+    if (MaxLeaf >= 0x00000007)
+    {
+        x64_cpuid Extended = x64CPUID(0x00000007, 0);
+
+        Features->INVPCID = (Extended.EBX >> 10) & 1;
+        Features->LA57    = (Extended.ECX >> 16) & 1;
+    }
+
+    if (MaxExtendedLeaf >= 0x80000001)
+    {
+        x64_cpuid Extended = x64CPUID(0x80000001, 0);
+
+        Features->Pages1GB  = (Extended.EDX >> 26) & 1;
+        Features->NoExecute = (Extended.EDX >> 20) & 1;
+    }
+}
+
+local x64_page_map_state x64PageMapState = {.Generation = 1, .NextPCID = 1, .PagingLevels = 4};
+
+// NOTE(vak): The kernel page map and its root table live in the kernel
+// image, so that they stay reachable while the kernel moves over to the
+// direct map, and so that the root is below 4GB for the switch to LA57.
+
+local _Alignas(4096) x64_page_table x64KernelRoot = {0};
+local arch_page_map                 x64KernelPageMap = {0};
+
+local void x64SelectPagingLevels(void)
+{
+    x64_page_map_state* State = &x64PageMapState;
+
+    usize Code  = (usize)x64EnterLA57;
+    usize Stack = (usize)__builtin_frame_address(0);
+    usize Root  = (usize)&x64KernelRoot;
+
+    b32 Reachable = (Code < GB(4)) && (Stack < GB(4)) && (Root < GB(4));
+
+    if (x64ReadCR4() & x64_CR4_LA57)
+    {
+        // NOTE(vak): Enabled by the firmware.
+
+        State->PagingLevels = 5;
+    }
+    else if (x64_EnableLA57 && x64Features.LA57 && Reachable)
+    {
+        State->PagingLevels = 5;
+    }
+    else
+    {
+        State->PagingLevels = 4;
+    }
+}
+
+local void ArchDetectFeatures(void)
+{
+    x64DetectFeatures();
+    x64SelectPagingLevels();
+}
+
+// NOTE(vak): Features are detected while the firmware still owns the
+// serial port, so they are only reported once ArchSetup has taken it
+// over.
+
+local void x64LogFeatures(void)
+{
+    x64_features* Features = &x64Features;
+
+    SerialInfof(Str("CPU supports 1GB pages: %u32"), Features->Pages1GB);
+    SerialInfof(Str("CPU supports PCID: %u32, INVPCID: %u32"), Features->PCID, Features->INVPCID);
+    SerialInfof(Str("CPU supports PAT: %u32"), Features->PAT);
+    SerialInfof(Str("CPU supports global pages: %u32, NX: %u32"), Features->GlobalPages, Features->NoExecute);
+    SerialInfof(Str("CPU supports 5-level paging: %u32"), Features->LA57);
+    SerialInfof(Str("CPU supports APIC: %u32, x2APIC: %u32"), Features->APIC, Features->X2APIC);
+    SerialInfof(Str("Using %usize-level paging"), x64PageMapState.PagingLevels);
+}
+
+local naked void x64EnterLA57(u64 CR3)
+{
+    __asm volatile
+    (
+        "pushq %%rbx\n"
+        "pushq %%rbp\n"
+        "movq %%rcx, %%rbx\n"
+
+        // NOTE(vak): Build the far pointer back to long mode on the
+        // stack. Memory can't be addressed with RIP in compatibility
+        // mode, so keep a pointer to it in EBP.
+
+        "subq $16, %%rsp\n"
+        "leaq 2f(%%rip), %%rax\n"
+        "movl %%eax, 0(%%rsp)\n"
+        "movw %2, 4(%%rsp)\n"
+        "movq %%rsp, %%rbp\n"
+
+        // NOTE(vak): Far return to the 32-bit code segment.
+
+        "leaq 1f(%%rip), %%rax\n"
+        "pushq %0\n"
+        "pushq %%rax\n"
+        "lretq\n"
+
+        ".code32\n"
+        "1:\n"
+
+        // NOTE(vak): The 64-bit data segment has no limit, so it can't
+        // be used outside of long mode.
+
+        "movw %1, %%ax\n"
+        "movw %%ax, %%ds\n"
+        "movw %%ax, %%ss\n"
+
+        // NOTE(vak): Turning paging off leaves long mode, LA57 can be
+        // set now, and turning paging back on with the new root table
+        // re-enters long mode, as EFER.LME is still set.
+
+        "movl %%cr0, %%eax\n"
+        "andl $0x7FFFFFFF, %%eax\n"
+        "movl %%eax, %%cr0\n"
+
+        "movl %%cr4, %%eax\n"
+        "orl $0x1000, %%eax\n"
+        "movl %%eax, %%cr4\n"
+
+        "movl %%ebx, %%cr3\n"
+
+        "movl %%cr0, %%eax\n"
+        "orl $0x80000000, %%eax\n"
+        "movl %%eax, %%cr0\n"
+
+        "ljmpl *(%%ebp)\n"
+
+        ".code64\n"
+        "2:\n"
+
+        "movw %3, %%ax\n"
+        "movw %%ax, %%ds\n"
+        "movw %%ax, %%ss\n"
+
+        "addq $16, %%rsp\n"
+        "popq %%rbp\n"
+        "popq %%rbx\n"
+        "retq\n"
+
+        :: "i"(x64_GDT_KernelCode32), "i"(x64_GDT_KernelData32),
+           "i"(x64_GDT_KernelCode),   "i"(x64_GDT_KernelData)
+    );
+}
+
+local void x64SwitchToLA57(usize Root)
+{
+    // NOTE(vak): Paging can't be turned off while PCIDs are enabled,
+    // and no interrupt can be taken outside of long mode.
+
+    b32 Enabled = ArchDisableInterrupts();
+    u64 CR4     = x64ReadCR4();
+
+    x64WriteCR4(CR4 & ~x64_CR4_PCIDE);
+    x64EnterLA57(Root);
+    x64WriteCR4(x64ReadCR4() | (CR4 & x64_CR4_PCIDE));
+
+    ArchRestoreInterrupts(Enabled);
+}
+
+local x64_interrupt_entry x64InterruptTable[ArchInterruptVectorCount] = {0};
+local spin_lock           x64InterruptLock = {0};
+
+local string x64GetExceptionName(usize Vector)
+{
+    persist string Names[x64_ExceptionCount] =
     {
         [ 0] = Str("Division By 0"),
         [ 1] = Str("Debug Exception"),
@@ -51,354 +440,1922 @@ local void x64InterruptDispatch(x64_interrupt_frame* Frame)
         [21] = Str("Control Protection Exception"),
     };
 
-    if (Frame->Vector < 32)
+    string Result = Str("Reserved");
+
+    if ((Vector < x64_ExceptionCount) && Names[Vector].Size)
+        Result = Names[Vector];
+
+    return (Result);
+}
+
+local void x64HandleException(arch_interrupt_frame* Frame, void* Context)
+{
+    string Name = x64GetExceptionName(Frame->Vector);
+
+    // NOTE(vak): Breakpoints and debug exceptions are the only ones that
+    // can be resumed without fixing anything, returning from any other
+    // would run the faulting instruction again.
+
+    if ((Frame->Vector == 1) || (Frame->Vector == 3))
     {
-        string Name = Names[Frame->Vector];
-        if (Name.Size)
-        {
-            if (Frame->ErrorCode)
-            {
-                SerialErrorf(Str("INT #%u64: %str"), Frame->Vector, Name);
-            }
-            else
-            {
-                SerialDebugf(Str("INT #%u64: %str"), Frame->Vector, Name);
-            }
-        }
+        SerialDebugf(Str("INT #%u64: %str at 0x%p"), Frame->Vector, Name, Frame->RIP);
+    }
+    else
+    {
+        SerialErrorf(
+            Str("INT #%u64: %str at 0x%p (error code 0x%x64)."),
+            Frame->Vector,
+            Name,
+            Frame->RIP,
+            Frame->ErrorCode
+        );
+
+        x64Halt();
     }
 }
 
-local naked void x64InterruptStub(void)
+// NOTE(vak): Double faults and machine checks are aborts, the state they
+// interrupted can't be returned to.
+
+local void x64HandleAbort(arch_interrupt_frame* Frame, void* Context)
 {
-    __asm volatile
-    (
-        // NOTE(vak): Push registers
+    SerialErrorf(
+        Str("INT #%u64: %str at 0x%p, aborting."),
+        Frame->Vector,
+        x64GetExceptionName(Frame->Vector),
+        Frame->RIP
+    );
 
-        "pushq %%rbp\n"
-        "pushq %%rax\n"
-        "pushq %%rbx\n"
-        "pushq %%rcx\n"
-        "pushq %%rdx\n"
-        "pushq %%rsi\n"
-        "pushq %%rdi\n"
-        "pushq %%r8\n"
-        "pushq %%r9\n"
-        "pushq %%r10\n"
-        "pushq %%r11\n"
-        "pushq %%r12\n"
-        "pushq %%r13\n"
-        "pushq %%r14\n"
-        "pushq %%r15\n"
+    x64Halt();
+}
+
+local void x64HandlePageFault(arch_interrupt_frame* Frame, void* Context)
+{
+    // NOTE(vak): Page faults are resolved by the kernel if the address
+    // belongs to a reserved region, otherwise they are fatal.
+
+    u64 Address   = x64ReadCR2();
+    u64 ErrorCode = Frame->ErrorCode;
+
+    arch_fault_flags Flags = 0;
+
+    if (ErrorCode & (1 << 0)) Flags |= ArchFaultFlag_Present;
+    if (ErrorCode & (1 << 1)) Flags |= ArchFaultFlag_Write;
+    if (ErrorCode & (1 << 2)) Flags |= ArchFaultFlag_User;
+    if (ErrorCode & (1 << 4)) Flags |= ArchFaultFlag_Execute;
+
+    if (!HandlePageFault(Address, Flags))
+    {
+        SerialErrorf(Str("Unhandled page fault at 0x%p (error code 0x%x64)."), Address, ErrorCode);
+        x64Halt();
+    }
+}
+
+local void x64HandleUnexpected(arch_interrupt_frame* Frame, void* Context)
+{
+    SerialWarnf(Str("Unexpected interrupt on vector %u64."), Frame->Vector);
+}
+
+local arch_interrupt_handler* x64GetDefaultHandler(usize Vector)
+{
+    arch_interrupt_handler* Result = x64HandleUnexpected;
+
+    if (Vector == 14)
+    {
+        Result = x64HandlePageFault;
+    }
+    else if ((Vector == 8) || (Vector == 18))
+    {
+        Result = x64HandleAbort;
+    }
+    else if (Vector < x64_ExceptionCount)
+    {
+        Result = x64HandleException;
+    }
+
+    return (Result);
+}
+
+local void x64InterruptDispatch(arch_interrupt_frame* Frame)
+{
+    x64_interrupt_entry* Entry = x64InterruptTable + (u8)(Frame->Vector);
+    Entry->Handler(Frame, Entry->Context);
+}
+
+// NOTE(vak): Handlers only ever replace a default handler, which
+// ignores its context, and the other way around. The context is stored
+// before the handler, so that a handler never sees another's context
+// when it runs on another processor at the same time.
+
+local void x64SetInterruptEntry(usize Vector, arch_interrupt_handler* Handler, void* Context)
+{
+    x64_interrupt_entry* Entry = x64InterruptTable + Vector;
+
+    __atomic_store_n(&Entry->Context, Context, __ATOMIC_RELEASE);
+    __atomic_store_n(&Entry->Handler, Handler, __ATOMIC_RELEASE);
+}
+
+local b32 ArchSetInterruptHandler(usize Vector, arch_interrupt_handler* Handler, void* Context)
+{
+    b32 Result = false;
+
+    if ((Vector >= ArchInterruptVectorCount) || !Handler)
+    {
+        SerialErrorf(Str("Invalid interrupt handler for vector %usize."), Vector);
+    }
+    else
+    {
+        b32 Enabled = ArchDisableInterrupts();
+        AcquireLock(&x64InterruptLock);
+
+        if (x64InterruptTable[Vector].Handler == x64GetDefaultHandler(Vector))
+        {
+            x64SetInterruptEntry(Vector, Handler, Context);
+            Result = true;
+        }
+
+        ReleaseLock(&x64InterruptLock);
+        ArchRestoreInterrupts(Enabled);
+
+        if (!Result)
+        {
+            SerialErrorf(Str("Interrupt vector %usize already has a handler."), Vector);
+        }
+    }
+
+    return (Result);
+}
+
+local void ArchClearInterruptHandler(usize Vector)
+{
+    if (Vector < ArchInterruptVectorCount)
+    {
+        b32 Enabled = ArchDisableInterrupts();
+        AcquireLock(&x64InterruptLock);
+
+        x64SetInterruptEntry(Vector, x64GetDefaultHandler(Vector), 0);
+
+        ReleaseLock(&x64InterruptLock);
+        ArchRestoreInterrupts(Enabled);
+    }
+}
+
+local usize ArchAllocateInterruptVector(arch_interrupt_handler* Handler, void* Context)
+{
+    usize Result = 0;
+
+    b32 Enabled = ArchDisableInterrupts();
+    AcquireLock(&x64InterruptLock);
+
+    for (usize Vector = x64_ExceptionCount; Vector < ArchInterruptVectorCount; Vector++)
+    {
+        if (x64InterruptTable[Vector].Handler == x64HandleUnexpected)
+        {
+            x64SetInterruptEntry(Vector, Handler, Context);
+            Result = Vector;
+            break;
+        }
+    }
+
+    ReleaseLock(&x64InterruptLock);
+    ArchRestoreInterrupts(Enabled);
+
+    if (!Result)
+    {
+        SerialErrorf(Str("No free interrupt vectors left."));
+    }
+
+    return (Result);
+}
+
+local usize ArchGetInterruptVector(arch_interrupt_frame* Frame)
+{
+    return (Frame->Vector);
+}
+
+local naked void x64InterruptStub(void)
+{
+    __asm volatile
+    (
+        // NOTE(vak): Push registers
+
+        "pushq %%rbp\n"
+        "pushq %%rax\n"
+        "pushq %%rbx\n"
+        "pushq %%rcx\n"
+        "pushq %%rdx\n"
+        "pushq %%rsi\n"
+        "pushq %%rdi\n"
+        "pushq %%r8\n"
+        "pushq %%r9\n"
+        "pushq %%r10\n"
+        "pushq %%r11\n"
+        "pushq %%r12\n"
+        "pushq %%r13\n"
+        "pushq %%r14\n"
+        "pushq %%r15\n"
+
+        // NOTE(vak): The frame is 16 byte aligned at this point, and
+        // the callee may use 32 bytes above the return address as its
+        // home area, which mustn't overlap the saved registers. XMM0-5
+        // are volatile as well, and the compiler uses them to copy
+        // structures, so they are saved above the home area. The ABI
+        // expects the direction flag to be clear on calls.
+
+        "movq %%rsp, %%rcx\n"
+        "subq $128, %%rsp\n"
+        "movdqa %%xmm0, 32(%%rsp)\n"
+        "movdqa %%xmm1, 48(%%rsp)\n"
+        "movdqa %%xmm2, 64(%%rsp)\n"
+        "movdqa %%xmm3, 80(%%rsp)\n"
+        "movdqa %%xmm4, 96(%%rsp)\n"
+        "movdqa %%xmm5, 112(%%rsp)\n"
+        "cld\n"
+        "call %P0\n"
+        "movdqa 32(%%rsp), %%xmm0\n"
+        "movdqa 48(%%rsp), %%xmm1\n"
+        "movdqa 64(%%rsp), %%xmm2\n"
+        "movdqa 80(%%rsp), %%xmm3\n"
+        "movdqa 96(%%rsp), %%xmm4\n"
+        "movdqa 112(%%rsp), %%xmm5\n"
+        "addq $128, %%rsp\n"
+
+        // NOTE(vak): Pop registers
+
+        "popq %%r15\n"
+        "popq %%r14\n"
+        "popq %%r13\n"
+        "popq %%r12\n"
+        "popq %%r11\n"
+        "popq %%r10\n"
+        "popq %%r9\n"
+        "popq %%r8\n"
+        "popq %%rdi\n"
+        "popq %%rsi\n"
+        "popq %%rdx\n"
+        "popq %%rcx\n"
+        "popq %%rbx\n"
+        "popq %%rax\n"
+        "popq %%rbp\n"
+
+        // NOTE(vak): Pop interrupt number + error code
+
+        "add $16, %%rsp\n"
+
+        // NOTE(vak): Return from interrupt
+
+        "iretq\n"
+
+        :: "i"(x64InterruptDispatch)
+    );
+}
+
+local x64_lapic_state x64LAPIC = {0};
+
+local void x64IOWait(void)
+{
+    // NOTE(vak): Writing to an unused port gives the PIC time to settle.
+
+    x64OutByte(0x80, 0);
+}
+
+local void x64DisablePIC(void)
+{
+    // NOTE(vak): Initialization sequence, the data port takes the vector
+    // base, how the two are cascaded, and the 8086 mode.
+
+    x64OutByte(x64_PIC1Command, 0x11); x64IOWait();
+    x64OutByte(x64_PIC2Command, 0x11); x64IOWait();
+
+    x64OutByte(x64_PIC1Data, x64_PICVectorBase + 0); x64IOWait();
+    x64OutByte(x64_PIC2Data, x64_PICVectorBase + 8); x64IOWait();
+
+    x64OutByte(x64_PIC1Data, 0x04); x64IOWait(); // NOTE(vak): Secondary on IRQ 2
+    x64OutByte(x64_PIC2Data, 0x02); x64IOWait(); // NOTE(vak): Cascade identity
+
+    x64OutByte(x64_PIC1Data, 0x01); x64IOWait();
+    x64OutByte(x64_PIC2Data, 0x01); x64IOWait();
+
+    // NOTE(vak): Mask every line
+
+    x64OutByte(x64_PIC1Data, 0xFF);
+    x64OutByte(x64_PIC2Data, 0xFF);
+}
+
+local u32 x64LAPICRead(u32 Register)
+{
+    u32 Result = 0;
+
+    if (x64LAPIC.X2APIC)
+    {
+        Result = (u32)x64ReadMSR(x64_MSR_X2APIC + (Register >> 4));
+    }
+    else
+    {
+        Result = *(volatile u32*)(x64LAPIC.Registers + Register);
+    }
+
+    return (Result);
+}
+
+local void x64LAPICWrite(u32 Register, u32 Value)
+{
+    if (x64LAPIC.X2APIC)
+    {
+        x64WriteMSR(x64_MSR_X2APIC + (Register >> 4), Value);
+    }
+    else
+    {
+        *(volatile u32*)(x64LAPIC.Registers + Register) = Value;
+    }
+}
+
+local void x64HandleSpurious(arch_interrupt_frame* Frame, void* Context)
+{
+    // NOTE(vak): Spurious interrupts don't take an EOI.
+}
+
+local void x64HandleAPICError(arch_interrupt_frame* Frame, void* Context)
+{
+    // NOTE(vak): The error status register latches on a write.
+
+    x64LAPICWrite(x64_LAPIC_ESR, 0);
+    u32 Status = x64LAPICRead(x64_LAPIC_ESR);
+
+    SerialErrorf(Str("APIC error 0x%x32 on CPU %usize."), Status, ArchGetCPUIndex());
+
+    ArchEndOfInterrupt();
+}
+
+local void ArchSetupInterruptController(void)
+{
+    if (!x64Features.APIC)
+    {
+        SerialErrorf(Str("CPU has no local APIC, device interrupts are unavailable."));
+        return;
+    }
+
+    u64 Base = x64ReadMSR(x64_MSR_APICBase);
+
+    x64LAPIC.X2APIC = x64Features.X2APIC;
+
+    if (x64LAPIC.X2APIC)
+    {
+        // NOTE(vak): x2APIC mode can only be entered from xAPIC mode.
+
+        Base |= x64_APICBase_Enable;
+        x64WriteMSR(x64_MSR_APICBase, Base);
+
+        Base |= x64_APICBase_X2APIC;
+        x64WriteMSR(x64_MSR_APICBase, Base);
+    }
+    else
+    {
+        usize Physical = Base & x64_APICBase_AddressMask;
+
+        b32 Mapped = ArchMapRange(
+            ArchGetKernelPageMap(),
+            Physical,
+            ArchGetDirectMapBase() + Physical,
+            ArchGetPageSize(),
+            ArchMapFlag_Write | ArchMapFlag_Uncached | ArchMapFlag_Global
+        );
+
+        if (!Mapped)
+        {
+            SerialErrorf(Str("Unable to map the local APIC at 0x%p, device interrupts are unavailable."), Physical);
+            return;
+        }
+
+        x64WriteMSR(x64_MSR_APICBase, Base | x64_APICBase_Enable);
+
+        x64LAPIC.Registers = (usize)PhysicalToVirtual(Physical);
+    }
+
+    // NOTE(vak): The vectors the legacy PICs can still raise are claimed
+    // up front, so that they are never handed out.
+
+    ArchSetInterruptHandler(x64_PICVectorBase + 7,  x64HandleSpurious, 0);
+    ArchSetInterruptHandler(x64_PICVectorBase + 15, x64HandleSpurious, 0);
+    ArchSetInterruptHandler(x64_SpuriousVector,     x64HandleSpurious, 0);
+    ArchSetInterruptHandler(x64_APICErrorVector,    x64HandleAPICError, 0);
+
+    // NOTE(vak): Nothing is wired to LINT0 with the PICs masked, LINT1
+    // carries NMIs, and the timer stays off until something uses it.
+
+    x64LAPICWrite(x64_LAPIC_LVTTimer, x64_LVT_Masked);
+    x64LAPICWrite(x64_LAPIC_LVTLINT0, x64_LVT_Masked);
+    x64LAPICWrite(x64_LAPIC_LVTLINT1, x64_LVT_NMI);
+    x64LAPICWrite(x64_LAPIC_LVTError, x64_APICErrorVector);
+
+    x64LAPICWrite(x64_LAPIC_ESR, 0);
+    x64LAPICWrite(x64_LAPIC_ESR, 0);
+
+    ArchSetInterruptPriority(0);
+
+    x64LAPICWrite(x64_LAPIC_SVR, x64_LAPIC_SVREnable | x64_SpuriousVector);
+
+    // NOTE(vak): Acknowledge anything that was left in service.
+
+    ArchEndOfInterrupt();
+
+    SerialInfof(
+        Str("Enabled local APIC %u32 in %str mode (version 0x%x32)"),
+        ArchGetInterruptControllerID(),
+        x64LAPIC.X2APIC ? Str("x2APIC") : Str("xAPIC"),
+        x64LAPICRead(x64_LAPIC_Version) & 0xFF
+    );
+}
+
+local void ArchEndOfInterrupt(void)
+{
+    x64LAPICWrite(x64_LAPIC_EOI, 0);
+}
+
+local void ArchSetInterruptPriority(usize Priority)
+{
+    x64LAPICWrite(x64_LAPIC_TPR, (u32)(Priority & 0xF) << 4);
+}
+
+local u32 ArchGetInterruptControllerID(void)
+{
+    u32 Result = x64LAPICRead(x64_LAPIC_ID);
+
+    // NOTE(vak): xAPIC IDs are 8 bits at the top of the register.
+
+    if (!x64LAPIC.X2APIC)
+        Result >>= 24;
+
+    return (Result);
+}
+
+local void ArchSendInterrupt(u32 TargetID, usize Vector)
+{
+    u32 Command = (u32)(Vector & 0xFF) | x64_ICR_Assert;
+
+    if (x64LAPIC.X2APIC)
+    {
+        x64WriteMSR(x64_MSR_X2APIC + (x64_LAPIC_ICRLow >> 4), ((u64)(TargetID) << 32) | Command);
+    }
+    else
+    {
+        b32 Enabled = ArchDisableInterrupts();
+
+        x64LAPICWrite(x64_LAPIC_ICRHigh, TargetID << 24);
+        x64LAPICWrite(x64_LAPIC_ICRLow,  Command);
+
+        while (x64LAPICRead(x64_LAPIC_ICRLow) & x64_ICR_Pending)
+            __asm volatile ("pause");
+
+        ArchRestoreInterrupts(Enabled);
+    }
+}
+
+local x64_ioapic_state x64IOAPICState = {0};
+
+local u32 x64IOAPICRead(x64_ioapic* IOAPIC, u32 Register)
+{
+    *(volatile u32*)(IOAPIC->Registers + x64_IOAPIC_Select) = Register;
+    u32 Result = *(volatile u32*)(IOAPIC->Registers + x64_IOAPIC_Window);
+
+    return (Result);
+}
+
+local void x64IOAPICWrite(x64_ioapic* IOAPIC, u32 Register, u32 Value)
+{
+    *(volatile u32*)(IOAPIC->Registers + x64_IOAPIC_Select) = Register;
+    *(volatile u32*)(IOAPIC->Registers + x64_IOAPIC_Window) = Value;
+}
+
+local x64_ioapic* x64FindIOAPIC(u32 GSI)
+{
+    x64_ioapic* Result = 0;
+
+    for (usize Index = 0; Index < x64IOAPICState.IOAPICCount; Index++)
+    {
+        x64_ioapic* IOAPIC = x64IOAPICState.IOAPICs + Index;
+
+        if ((GSI >= IOAPIC->GSIBase) && (GSI - IOAPIC->GSIBase < IOAPIC->InputCount))
+        {
+            Result = IOAPIC;
+            break;
+        }
+    }
+
+    return (Result);
+}
+
+local b32 x64SetRedirection(u32 GSI, u64 Entry)
+{
+    b32 Result = false;
+
+    x64_ioapic* IOAPIC = x64FindIOAPIC(GSI);
+
+    if (!IOAPIC)
+    {
+        SerialErrorf(Str("No IOAPIC handles GSI %u32."), GSI);
+    }
+    else
+    {
+        u32 Register = x64_IOAPIC_Redirection + 2 * (GSI - IOAPIC->GSIBase);
+
+        b32 Enabled = ArchDisableInterrupts();
+        AcquireLock(&IOAPIC->Lock);
+
+        // NOTE(vak): Mask the input while the entry is half written.
+
+        x64IOAPICWrite(IOAPIC, Register + 0, (u32)x64_Redirection_Masked);
+        x64IOAPICWrite(IOAPIC, Register + 1, (u32)(Entry >> 32));
+        x64IOAPICWrite(IOAPIC, Register + 0, (u32)(Entry));
+
+        ReleaseLock(&IOAPIC->Lock);
+        ArchRestoreInterrupts(Enabled);
+
+        Result = true;
+    }
+
+    return (Result);
+}
+
+local u64 x64GetRedirectionFlags(u16 INTIFlags, b32 DefaultLevel)
+{
+    u64 Result = 0;
+
+    // NOTE(vak): Bus defaults are active high and edge triggered for
+    // ISA, active low and level triggered for PCI.
+
+    u16 Polarity = INTIFlags & ACPI_INTI_PolarityMask;
+    u16 Trigger  = INTIFlags & ACPI_INTI_TriggerMask;
+
+    if ((Polarity == ACPI_INTI_ActiveLow) || (!Polarity && DefaultLevel))
+        Result |= x64_Redirection_ActiveLow;
+
+    if ((Trigger == ACPI_INTI_Level) || (!Trigger && DefaultLevel))
+        Result |= x64_Redirection_Level;
+
+    return (Result);
+}
+
+local void ArchSetupInterruptRouting(acpi_madt_info* MADT)
+{
+    x64_ioapic_state* State = &x64IOAPICState;
+
+    State->MADT        = MADT;
+    State->IOAPICCount = 0;
+
+    u32 CPU = ArchGetInterruptControllerID();
+
+    for (usize Index = 0; Index < MADT->IOAPICCount; Index++)
+    {
+        acpi_ioapic_info* Info = MADT->IOAPICs + Index;
+
+        // NOTE(vak): An IOAPIC whose registers can't be mapped is left
+        // out, its GSIs then fail to route instead of faulting.
+
+        b32 Mapped = ArchMapRange(
+            ArchGetKernelPageMap(),
+            Info->Address & ~(u64)(ArchGetPageSize() - 1),
+            ArchGetDirectMapBase() + (Info->Address & ~(u64)(ArchGetPageSize() - 1)),
+            ArchGetPageSize(),
+            ArchMapFlag_Write | ArchMapFlag_Uncached | ArchMapFlag_Global
+        );
+
+        if (!Mapped)
+        {
+            SerialErrorf(Str("Unable to map IOAPIC %u32 at 0x%p."), Info->ID, Info->Address);
+            continue;
+        }
+
+        x64_ioapic* IOAPIC = State->IOAPICs + State->IOAPICCount++;
+
+        IOAPIC->Registers  = (usize)PhysicalToVirtual(Info->Address);
+        IOAPIC->ID         = Info->ID;
+        IOAPIC->GSIBase    = Info->GSIBase;
+        IOAPIC->InputCount = ((x64IOAPICRead(IOAPIC, x64_IOAPIC_Version) >> 16) & 0xFF) + 1;
+
+        for (u32 Input = 0; Input < IOAPIC->InputCount; Input++)
+        {
+            x64IOAPICWrite(IOAPIC, x64_IOAPIC_Redirection + 2 * Input + 0, (u32)x64_Redirection_Masked);
+            x64IOAPICWrite(IOAPIC, x64_IOAPIC_Redirection + 2 * Input + 1, 0);
+        }
+
+        SerialInfof(
+            Str("IOAPIC %u32 at 0x%p: GSIs %u32-%u32"),
+            IOAPIC->ID,
+            Info->Address,
+            IOAPIC->GSIBase,
+            IOAPIC->GSIBase + IOAPIC->InputCount - 1
+        );
+    }
+
+    // NOTE(vak): NMI sources go to this processor, if an IOAPIC can
+    // address it.
+
+    if (MADT->NMISourceCount && (CPU > 0xFF))
+        SerialErrorf(Str("NMI sources can't be routed to APIC ID %u32."), CPU);
+
+    for (usize Index = 0; (CPU <= 0xFF) && (Index < MADT->NMISourceCount); Index++)
+    {
+        acpi_nmi_info* NMI = MADT->NMISources + Index;
+
+        u64 Entry = (
+            x64_Redirection_NMI |
+            x64GetRedirectionFlags(NMI->Flags, false) |
+            ((u64)(CPU) << x64_Redirection_DestinationShift)
+        );
+
+        // NOTE(vak): NMIs are always edge triggered.
+
+        x64SetRedirection(NMI->Input, Entry & ~x64_Redirection_Level);
+    }
+
+    // NOTE(vak): Set up the local APIC NMI inputs that apply to this
+    // processor, which are found by its APIC ID.
+
+    u32  ProcessorUID = ACPI_AllProcessorsX2;
+    b32  Found        = false;
+
+    for (usize Index = 0; Index < MADT->LocalAPICCount; Index++)
+    {
+        if (MADT->LocalAPICs[Index].APICID == CPU)
+        {
+            ProcessorUID = MADT->LocalAPICs[Index].ProcessorUID;
+            Found        = true;
+            break;
+        }
+    }
+
+    for (usize Index = 0; Found && (Index < MADT->LocalNMICount); Index++)
+    {
+        acpi_nmi_info* NMI = MADT->LocalNMIs + Index;
+
+        b32 Applies = (
+            (NMI->ProcessorUID == ACPI_AllProcessorsX2) ||
+            (NMI->ProcessorUID == ProcessorUID)
+        );
+
+        if (Applies && (NMI->Input <= 1))
+        {
+            u32 LVT = x64_LVT_NMI;
+
+            if ((NMI->Flags & ACPI_INTI_PolarityMask) == ACPI_INTI_ActiveLow)
+                LVT |= x64_LVT_ActiveLow;
+
+            x64LAPICWrite(NMI->Input ? x64_LAPIC_LVTLINT1 : x64_LAPIC_LVTLINT0, LVT);
+        }
+    }
+}
+
+local b32 ArchRouteInterrupt(u32 GSI, usize Vector, u32 TargetID, arch_interrupt_flags Flags)
+{
+    b32 Result = false;
+
+    if ((Vector < x64_ExceptionCount) || (Vector >= ArchInterruptVectorCount))
+    {
+        SerialErrorf(Str("Invalid vector %usize for GSI %u32."), Vector, GSI);
+    }
+    else if (TargetID > 0xFF)
+    {
+        // NOTE(vak): Larger IDs need interrupt remapping.
+
+        SerialErrorf(Str("GSI %u32 can't be routed to APIC ID %u32."), GSI, TargetID);
+    }
+    else
+    {
+        u64 Entry = (u64)(Vector) | ((u64)(TargetID) << x64_Redirection_DestinationShift);
+
+        if (Flags & ArchInterruptFlag_ActiveLow) Entry |= x64_Redirection_ActiveLow;
+        if (Flags & ArchInterruptFlag_Level)     Entry |= x64_Redirection_Level;
+
+        Result = x64SetRedirection(GSI, Entry);
+    }
+
+    return (Result);
+}
+
+local b32 ArchRouteISAInterrupt(u32 IRQ, usize Vector, u32 TargetID)
+{
+    b32 Result = false;
+
+    acpi_madt_info* MADT = x64IOAPICState.MADT;
+
+    if (!MADT)
+    {
+        SerialErrorf(Str("Interrupt routing isn't set up."));
+    }
+    else
+    {
+        u16 INTIFlags = 0;
+        u32 GSI       = ACPIGetISAInterrupt(MADT, IRQ, &INTIFlags);
+        u64 Redirect  = x64GetRedirectionFlags(INTIFlags, false);
+
+        arch_interrupt_flags Flags = 0;
+
+        if (Redirect & x64_Redirection_ActiveLow) Flags |= ArchInterruptFlag_ActiveLow;
+        if (Redirect & x64_Redirection_Level)     Flags |= ArchInterruptFlag_Level;
+
+        Result = ArchRouteInterrupt(GSI, Vector, TargetID, Flags);
+    }
+
+    return (Result);
+}
+
+local void ArchMaskInterrupt(u32 GSI)
+{
+    x64SetRedirection(GSI, x64_Redirection_Masked);
+}
+
+local b32 ArchGetMessageInterrupt(u32 TargetID, usize Vector, u64* Address, u32* Data)
+{
+    b32 Result = false;
+
+    if ((Vector < x64_ExceptionCount) || (Vector >= ArchInterruptVectorCount))
+    {
+        SerialErrorf(Str("Invalid vector %usize for a message interrupt."), Vector);
+    }
+    else if (TargetID > 0xFF)
+    {
+        SerialErrorf(Str("Message interrupts can't reach APIC ID %u32."), TargetID);
+    }
+    else
+    {
+        *Address = x64_MSI_Address | ((u64)(TargetID) << x64_MSI_DestinationShift);
+        *Data    = (u32)Vector;
+
+        Result = true;
+    }
+
+    return (Result);
+}
+
+local x64_gdt_entry x64GDT[x64_GDTEntryCount] =
+{
+    {0x0000, 0x0000, 0x00, 0x00, 0x00, 0x00}, // NOTE(vak): Null
+    {0x0000, 0x0000, 0x00, 0x9A, 0xA0, 0x00}, // NOTE(vak): Kernel code
+    {0x0000, 0x0000, 0x00, 0x92, 0xA0, 0x00}, // NOTE(vak): Kernel data
+    {0xFFFF, 0x0000, 0x00, 0x9A, 0xCF, 0x00}, // NOTE(vak): Kernel code (32-bit)
+    {0xFFFF, 0x0000, 0x00, 0x92, 0xCF, 0x00}, // NOTE(vak): Kernel data (32-bit)
+};
+
+local x64_idt x64IDT                 = {0};
+local x64_tss x64TSS[ArchMaxCPUCount] = {0};
+
+local void x64SetIDTEntry(
+    x64_idt* IDT,
+    u8       Index,
+    void*    Handler,
+    u8       GateType
+)
+{
+    u64 Address = (u64)Handler;
+
+    x64_idt_entry* Entry = IDT->Entries + Index;
+
+    Entry->Address0 = (Address & 0xFFFF);
+    Entry->CS       = 0x08;
+    Entry->IST      = 0;
+    Entry->Flags    = x64_GatePresent | GateType;
+    Entry->Address1 = (Address >> 16) & 0xFFFF;
+    Entry->Address2 = (Address >> 32) & 0xFFFFFFFF;
+    Entry->Reserved = 0;
+}
+
+// NOTE(vak): Returns the top of a new stack, or 0.
+
+local usize x64NewInterruptStack(void)
+{
+    usize Result = 0;
+
+    usize PageSize = ArchGetPageSize();
+    usize Size     = x64_ISTStackSize;
+
+    usize Order    = GetFrameOrder(Size);
+    usize Physical = ReservePages(Order);
+    usize Base     = VMemAllocate(GetKernelArena(), Size + PageSize, VMemFlag_InstantFit);
+
+    // NOTE(vak): The stack has to be mapped up front, a page fault on it
+    // would take the processor down.
+
+    b32 Mapped = (
+        Physical && Base &&
+        ArchMapRange(ArchGetKernelPageMap(), Physical, Base + PageSize, Size, ArchMapFlag_Write | ArchMapFlag_Global)
+    );
+
+    if (Mapped)
+    {
+        CountPages(MemoryUsage_Stacks, Size / PageSize);
+        Result = Base + PageSize + Size;
+    }
+    else
+    {
+        if (Physical && Base)
+            ArchUnmapRange(ArchGetKernelPageMap(), Base + PageSize, Size, false);
+
+        if (Physical) ReleasePages(Physical, Order);
+        if (Base)     VMemFree(GetKernelArena(), Base, Size + PageSize);
+    }
+
+    return (Result);
+}
+
+local void x64SetTSSDescriptor(usize CPUIndex, x64_tss* TSS)
+{
+    u64 Address = (u64)TSS;
+    u64 Limit   = sizeof(x64_tss) - 1;
+
+    x64_gdt_entry* Entry = x64GDT + (x64_GDT_TSS / sizeof(x64_gdt_entry)) + 2 * CPUIndex;
+
+    // NOTE(vak): System descriptors take two entries in long mode, the
+    // second one holds the upper half of the base.
+
+    Entry[0].Limit0         = (Limit & 0xFFFF);
+    Entry[0].Base0          = (Address & 0xFFFF);
+    Entry[0].Base1          = (Address >> 16) & 0xFF;
+    Entry[0].AccessFlags    = x64_TSSAccess;
+    Entry[0].Limit1AndFlags = (Limit >> 16) & 0x0F;
+    Entry[0].Base           = (Address >> 24) & 0xFF;
+
+    Entry[1].Limit0         = (Address >> 32) & 0xFFFF;
+    Entry[1].Base0          = (Address >> 48) & 0xFFFF;
+    Entry[1].Base1          = 0;
+    Entry[1].AccessFlags    = 0;
+    Entry[1].Limit1AndFlags = 0;
+    Entry[1].Base           = 0;
+}
+
+local void ArchSetupInterruptStacks(void)
+{
+    usize    CPUIndex = ArchGetCPUIndex();
+    x64_tss* TSS      = x64TSS + CPUIndex;
+    b32      Ready    = true;
+
+    ZeroType(TSS);
+
+    // NOTE(vak): No I/O permission bitmap.
+
+    TSS->IOMapBase = sizeof(x64_tss);
+
+    for (usize Index = 0; Index < x64_ISTCount; Index++)
+    {
+        TSS->IST[Index] = x64NewInterruptStack();
+
+        if (!TSS->IST[Index])
+        {
+            Ready = false;
+            break;
+        }
+    }
+
+    if (!Ready)
+    {
+        SerialErrorf(Str("Unable to allocate interrupt stacks for CPU %usize."), CPUIndex);
+    }
+    else
+    {
+        x64SetTSSDescriptor(CPUIndex, TSS);
+
+        u16 Selector = (u16)(x64_GDT_TSS + 16 * CPUIndex);
+        __asm volatile ("ltr %0" :: "r"(Selector) : "memory");
+
+        // NOTE(vak): The IDT is shared, so this only has to happen
+        // once, but every processor needs its TSS loaded before it.
+
+        x64IDT.Entries[ 1].IST = x64_IST_Debug;
+        x64IDT.Entries[ 2].IST = x64_IST_NMI;
+        x64IDT.Entries[ 8].IST = x64_IST_DoubleFault;
+        x64IDT.Entries[18].IST = x64_IST_MachineCheck;
+
+        SerialInfof(Str("Loaded TSS with %usize interrupt stacks"), (usize)(x64_ISTCount));
+    }
+}
+
+local void ArchSetup(void)
+{
+    // NOTE(vak): Clear interrupts
+    {
+        __asm volatile ("cli");
+    }
+
+    // NOTE(vak): Setup serial port
+    {
+        x64OutByte(x64_COM1 + 3, 0x00); // NOTE(vak): Set DLAB to 0
+        x64OutByte(x64_COM1 + 1, 0x00); // NOTE(vak): Disable interrupts
+
+        x64OutByte(x64_COM1 + 3, 0x80); // NOTE(vak): Set DLAB to 1
+
+        // NOTE(vak): Set divisor to 0x0003, which corresponds
+        // to a baud rate of 38400 baud.
+        x64OutByte(x64_COM1 + 0, 0x03);
+        x64OutByte(x64_COM1 + 1, 0x00);
+
+        // NOTE(vak): Initialize line control register
+        //     + Set data length to 8 bits
+        //     + Set stop bits to 1
+        //     + Set no parity bits
+        //     + Disable break
+        //     + Set DLAB to 0
+        x64OutByte(x64_COM1 + 3, 0x03);
+
+        // NOTE(vak): Initialize FIFO control register
+        //     + Enable FIFO
+        //     + Enable clearing for receive/transmit buffers,
+        //     + Set byte threshold to 14 byte.
+        x64OutByte(x64_COM1 + 2, 0xC7);
+
+        // NOTE(vak): Initialize modem control register
+        //     + Enable "Data Terminal Ready"
+        //     + Enable "Request To Send"
+        //     + Enable "Out 1"
+        //     + Enable "Out 2"
+        //     + Disable "Loop"
+        x64OutByte(x64_COM1 + 4, 0x0F);
+
+        // NOTE(vak): UEFI can output garbage to the serial port,
+        // so print a couple of newlines to seperate from that.
+
+        SerialPrintf(Str("\n\n"));
+        SerialInfof (Str("Initialized serial port COM1"));
+
+        x64LogFeatures();
+    }
+
+    // NOTE(vak): Remap and mask the legacy PICs
+    {
+        x64DisablePIC();
+
+        SerialInfof(Str("Masked legacy PIC"));
+    }
+
+    // NOTE(vak): Setup global descriptor table (GDT)
+    {
+        x64_gdt_register GDTR =
+        {
+            .Limit   = sizeof(x64GDT) - 1,
+            .Address = (u64)x64GDT,
+        };
+
+        __asm volatile
+        (
+            // NOTE(vak): Load global descriptor table register (GDTR)
+            "    lgdtq %0\n"
+
+            // NOTE(vak): Load data segment offset
+            "    movw $0x10, %%ax\n"
+            "    movw %%ax, %%es\n"
+            "    movw %%ax, %%ds\n"
+            "    movw %%ax, %%fs\n"
+            "    movw %%ax, %%gs\n"
+            "    movw %%ax, %%ss\n"
+
+            // NOTE(vak): Load code segment offset by performing a long
+            // jump, which pops the return address and the code segment
+            // offset off of the stack.
+            "    lea (DummyLabel), %%rax\n"
+            "    pushq $0x08\n" // NOTE(vak): Code segment offset
+            "    pushq %%rax\n" // NOTE(vak): Return address
+            "    lretq\n"
+            "DummyLabel:\n"
+
+            :: "m"(GDTR) : "rax"
+        );
+
+        SerialInfof(Str("Loaded GDT"));
+    }
+
+    // NOTE(vak): Setup interrupt descriptor table (IDT)
+    {
+        x64_idt* IDT = &x64IDT;
+
+        // NOTE(vak): Fill in all 256 vectors. The first 32 are used by
+        // the processor to report faults, debug breaks, ... the rest are
+        // left to devices and other processors.
+
+        #define x64_InterruptStub(Vector) [Vector] = (void*)x64Interrupt##Vector,
+
+        persist void* Stubs[ArchInterruptVectorCount] =
+        {
+            x64_InterruptVectors(x64_InterruptStub, x64_InterruptStub)
+        };
+
+        #undef x64_InterruptStub
+
+        for (usize Vector = 0; Vector < ArchInterruptVectorCount; Vector++)
+        {
+            // NOTE(vak): Everything uses interrupt gates, so that handlers
+            // aren't interrupted themselves. Page faults rely on it, an
+            // interrupt that faults before CR2 is read would replace it.
+
+            x64SetIDTEntry(IDT, Vector, Stubs[Vector], x64_GateType_Interrupt);
+
+            if (!x64InterruptTable[Vector].Handler)
+                x64SetInterruptEntry(Vector, x64GetDefaultHandler(Vector), 0);
+        }
+
+        // NOTE(vak): Load IDT
+
+        x64_idt_register IDTR =
+        {
+            .Limit   = sizeof(x64_idt) - 1,
+            .Address = (usize)IDT,
+        };
+
+        __asm volatile
+        (
+            "lidt %0\n"
+            "sti\n"
+            :: "m"(IDTR)
+        );
+
+        SerialInfof(Str("Loaded IDT"));
+    }
+
+    // NOTE(vak): Enable process-context identifiers. This requires
+    // the current PCID (the low 12 bits of CR3) to be 0.
+    {
+        if (x64Features.PCID && (x64ReadCR3() & 0xFFF) == 0)
+        {
+            x64WriteCR4(x64ReadCR4() | x64_CR4_PCIDE);
+            SerialInfof(Str("Enabled PCID"));
+        }
+        else
+        {
+            x64Features.PCID    = false;
+            x64Features.INVPCID = false;
+        }
+    }
+
+    // NOTE(vak): Program the page attribute table. Caches are written
+    // back first, and the TLB is flushed afterwards, so that no stale
+    // memory types are left behind.
+    {
+        if (x64Features.PAT)
+        {
+            __asm volatile ("wbinvd" ::: "memory");
+
+            x64WriteMSR(x64_MSR_PAT, x64_PATValue);
+            x64WriteCR3(x64ReadCR3());
+
+            SerialInfof(Str("Programmed PAT"));
+        }
+    }
+
+    // NOTE(vak): Enable global pages and the execute-disable bit.
+    {
+        if (x64Features.GlobalPages)
+        {
+            x64WriteCR4(x64ReadCR4() | x64_CR4_PGE);
+        }
+
+        if (x64Features.NoExecute)
+        {
+            x64WriteMSR(x64_MSR_EFER, x64ReadMSR(x64_MSR_EFER) | x64_EFER_NXE);
+        }
+    }
+}
+
+local void ArchWriteSerial(void* Buffer, usize Size)
+{
+    u8* Bytes = (u8*)Buffer;
+
+    for (usize Index = 0; Index < Size; Index++)
+    {
+        // NOTE(vak): Wait for transmission buffer to be empty
+
+        for (;;)
+        {
+            u8 LineStatus = x64InByte(x64_COM1 + 5);
+            if (LineStatus & 0x20)
+                break;
+        }
+
+        // NOTE(vak): Transmit byte
+
+        x64OutByte(x64_COM1 + 0, Bytes[Index]);
+    }
+}
+
+local usize ArchGetPageSize(void)
+{
+    return KB(4);
+}
+
+local b32 ArchIsPageSizeSupported(usize PageSize)
+{
+    b32 Result = (
+        (PageSize == KB(4)) ||
+        (PageSize == MB(2)) ||
+        (PageSize == GB(1) && x64Features.Pages1GB)
+    );
+
+    return (Result);
+}
+
+local usize ArchGetDirectMapBase(void)
+{
+    usize Result = (x64PageMapState.PagingLevels == 5) ? x64_DirectMapBase57 : x64_DirectMapBase;
+    return (Result);
+}
+
+local usize ArchGetDirectMapSize(void)
+{
+    usize Result = (x64PageMapState.PagingLevels == 5) ? x64_DirectMapSize57 : x64_DirectMapSize;
+    return (Result);
+}
+
+local usize ArchGetKernelArenaBase(void)
+{
+    usize Result = ArchGetDirectMapBase() + ArchGetDirectMapSize();
+    return (Result);
+}
+
+local usize ArchGetKernelArenaSize(void)
+{
+    return (x64_KernelArenaSize);
+}
+
+local x64_page_table* x64GetPageTable(usize Address)
+{
+    x64_page_table* Result = (x64_page_table*)PhysicalToVirtual(Address);
+    return (Result);
+}
+
+local usize x64NewPageTable(void)
+{
+    x64_page_map_state* State = &x64PageMapState;
+
+    usize Table = 0;
+
+    // NOTE(vak): Page tables come out of the pool handed over by the
+    // bootloader for as long as it lasts.
+
+    if (State->TablePool < State->TablePoolEnd)
+    {
+        Table = State->TablePool;
+        State->TablePool += ArchGetPageSize();
+
+        ZeroType(x64GetPageTable(Table));
+    }
+    else
+    {
+        Table = ReserveZeroedPage();
+    }
+
+    if (Table)
+        CountPages(MemoryUsage_PageTables, 1);
+
+    return (Table);
+}
+
+local void ArchSetPageTablePool(usize Address, usize Size)
+{
+    x64_page_map_state* State = &x64PageMapState;
+
+    State->TablePool    = Address;
+    State->TablePoolEnd = Address + Size;
+}
+
+local usize ArchGetPageTableBound(usize Size, b32 LargePages)
+{
+    usize Result = 0;
+    usize Levels = x64PageMapState.PagingLevels;
+
+    // NOTE(vak): The root table always exists. Below it, a range needs
+    // one table per span that a table covers, plus one at either end.
+    // With large pages, 4KB tables are only needed at the ends.
+
+    for (usize Level = 0; Level + 1 < Levels; Level++)
+    {
+        usize EntrySize = KB(4) << (9 * Level);
+
+        Result += 2;
+
+        if (!LargePages || (Level > 0))
+            Result += Size / (EntrySize * 512);
+    }
+
+    return (Result);
+}
+
+local arch_page_map* ArchGetKernelPageMap(void)
+{
+    arch_page_map* PageMap = &x64KernelPageMap;
+
+    // NOTE(vak): The image is identity mapped until the kernel page map
+    // is used, so the address of the root table is also its physical
+    // address.
+
+    if (!PageMap->Root)
+    {
+        x64_page_map_state* State = &x64PageMapState;
+
+        usize Shift = 12 + 9 * (State->PagingLevels - 1);
+        usize Stack = (usize)&PageMap;
+
+        PageMap->Root = (usize)&x64KernelRoot;
+
+        // NOTE(vak): The bootloader calls this first, on the stack the
+        // kernel keeps running on.
+
+        State->ImageRootIndex = ((usize)&x64KernelRoot >> Shift) & 0x1FF;
+        State->StackRootIndex = (Stack >> Shift) & 0x1FF;
+    }
+
+    return (PageMap);
+}
+
+local b32 x64IsKernelRootIndex(usize Index)
+{
+    x64_page_map_state* State = &x64PageMapState;
+
+    b32 Result = (
+        (Index >= x64_KernelRootIndex) ||
+        (Index == State->ImageRootIndex) ||
+        (Index == State->StackRootIndex)
+    );
+
+    return (Result);
+}
+
+local arch_page_map* ArchNewPageMap(void)
+{
+    x64_page_map_state* State = &x64PageMapState;
+
+    if (!State->PageMapCache)
+        State->PageMapCache = CreateSlabCache(Str("arch_page_map"), sizeof(arch_page_map), 0, 0);
+
+    arch_page_map* PageMap = (arch_page_map*)SlabAllocate(State->PageMapCache);
+
+    if (PageMap)
+    {
+        ZeroType(PageMap);
+        PageMap->Root = x64NewPageTable();
+
+        if (!PageMap->Root)
+        {
+            SlabFree(State->PageMapCache, PageMap);
+            PageMap = 0;
+        }
+    }
+
+    if (PageMap)
+    {
+        x64_page_table* Kernel = x64GetPageTable(ArchGetKernelPageMap()->Root);
+        x64_page_table* Root   = x64GetPageTable(PageMap->Root);
+
+        b32 Enabled = ArchDisableInterrupts();
+        AcquireLock(&State->PageMapLock);
+
+        for (usize Index = 0; Index < 512; Index++)
+        {
+            if (x64IsKernelRootIndex(Index))
+                Root->Entries[Index] = Kernel->Entries[Index];
+        }
+
+        PageMap->Next   = State->PageMaps;
+        State->PageMaps = PageMap;
+
+        ReleaseLock(&State->PageMapLock);
+        ArchRestoreInterrupts(Enabled);
+    }
+
+    return (PageMap);
+}
+
+// NOTE(vak): Copies the kernel root entries covering a range that was
+// just mapped into the kernel page map to every other page map.
+
+local void x64SyncKernelRoot(usize VirtualAddress, usize Size)
+{
+    x64_page_map_state* State = &x64PageMapState;
+
+    usize Shift = 12 + 9 * (State->PagingLevels - 1);
+    usize First = (VirtualAddress >> Shift) & 0x1FF;
+    usize Last  = ((VirtualAddress + Size - 1) >> Shift) & 0x1FF;
+
+    x64_page_table* Kernel = x64GetPageTable(x64KernelPageMap.Root);
+
+    b32 Enabled = ArchDisableInterrupts();
+    AcquireLock(&State->PageMapLock);
+
+    for (arch_page_map* PageMap = State->PageMaps; PageMap; PageMap = PageMap->Next)
+    {
+        x64_page_table* Root = x64GetPageTable(PageMap->Root);
+
+        for (usize Index = First; Index <= Last; Index++)
+        {
+            if (x64IsKernelRootIndex(Index))
+                Root->Entries[Index] = Kernel->Entries[Index];
+        }
+    }
+
+    ReleaseLock(&State->PageMapLock);
+    ArchRestoreInterrupts(Enabled);
+}
+
+// NOTE(vak): Returns 0 if a page table had to be allocated and there
+// was none left, in which case the entry is left alone.
+
+local x64_page_table* x64LookupPageTable(
+    x64_page_table* Table,
+    usize           Index,
+    usize           EntrySize
+)
+{
+    if (Index >= 512) return (0);
+
+    u64 Entry = Table->Entries[Index];
+
+    if ((Entry & x64_PageFlag_Present) == 0)
+    {
+        // NOTE(vak): Allocate a new page table if it doesn't exist.
+        // Table entries are permissive, the leaf entries decide the
+        // actual access rights.
+
+        u64 Flags   = x64_PageTableFlags;
+        u64 Address = x64NewPageTable();
+
+        if (!Address) return (0);
+
+        Table->Entries[Index] = Address | Flags;
+    }
+    else if (Entry & x64_PageFlag_PageSize)
+    {
+        // NOTE(vak): The entry maps a large page, so split it into a
+        // table of smaller pages that map the same range.
+
+        usize Address = x64NewPageTable();
+
+        if (!Address) return (0);
+
+        x64_page_table* New = x64GetPageTable(Address);
+
+        usize ChildSize = EntrySize / 512;
+        u64   Base      = Entry & x64_PageAddressMask & ~(u64)(EntrySize - 1);
+        u64   Flags     = Entry & x64_PageFlagsMask;
+        b32   PAT       = (Entry & x64_PageFlag_PATLarge) != 0;
+
+        // NOTE(vak): The PAT bit moves to bit 7 in 4KB entries, which
+        // is where large entries keep their page size bit.
+
+        if (ChildSize == KB(4))
+        {
+            Flags &= ~x64_PageFlag_PageSize;
+
+            if (PAT) Flags |= x64_PageFlag_PAT;
+        }
+        else
+        {
+            if (PAT) Flags |= x64_PageFlag_PATLarge;
+        }
+
+        for (usize Child = 0; Child < 512; Child++)
+        {
+            New->Entries[Child] = (Base + Child * ChildSize) | Flags;
+        }
+
+        Table->Entries[Index] = Address | x64_PageTableFlags;
+    }
+
+    // NOTE(vak): Retreive the page table address from the entry.
+
+    Entry = Table->Entries[Index];
+    x64_page_table* Result = x64GetPageTable(Entry & x64_PageAddressMask);
+
+    return (Result);
+}
+
+local u64 x64GetPageFlags(arch_map_flags MapFlags)
+{
+    u64 Result = x64_PageFlag_Present;
+
+    if (MapFlags & ArchMapFlag_Write) Result |= x64_PageFlag_ReadWrite;
+    if (MapFlags & ArchMapFlag_User ) Result |= x64_PageFlag_User;
+
+    if ((MapFlags & ArchMapFlag_Global) && x64Features.GlobalPages)
+        Result |= x64_PageFlag_Global;
+
+    if (!(MapFlags & ArchMapFlag_Execute) && x64Features.NoExecute)
+        Result |= x64_PageFlag_ExecuteDisable;
+
+    // NOTE(vak): Select the PAT entry of the cache type, see the table
+    // in arch_x64.h. The PAT bit itself depends on the page size, so
+    // it is set by x64IsPATMapping.
+
+    if (MapFlags & ArchMapFlag_Uncached)
+    {
+        Result |= x64_PageFlag_CacheDisable | x64_PageFlag_WriteThrough;
+    }
+    else if (MapFlags & ArchMapFlag_WriteCombining)
+    {
+        // NOTE(vak): Without a PAT, uncached is the closest match.
+
+        if (!x64Features.PAT)
+            Result |= x64_PageFlag_CacheDisable | x64_PageFlag_WriteThrough;
+    }
+    else if (MapFlags & ArchMapFlag_WriteThrough)
+    {
+        Result |= x64_PageFlag_WriteThrough;
+    }
+
+    return (Result);
+}
+
+local b32 x64IsPATMapping(arch_map_flags MapFlags)
+{
+    b32 Result = (
+        x64Features.PAT &&
+        (MapFlags & ArchMapFlag_WriteCombining) &&
+        !(MapFlags & ArchMapFlag_Uncached)
+    );
+
+    return (Result);
+}
+
+local void x64DeferRelease(usize* FreeList, usize Address, usize Size)
+{
+    x64_free_node* Node = (x64_free_node*)PhysicalToVirtual(Address);
+
+    Node->Next = *FreeList;
+    Node->Size = Size;
+
+    *FreeList = Address;
+}
+
+local void x64ReleaseDeferred(usize FreeList)
+{
+    while (FreeList)
+    {
+        x64_free_node* Node = (x64_free_node*)PhysicalToVirtual(FreeList);
+
+        usize Address = FreeList;
+        usize Order   = GetFrameOrder(Node->Size);
+
+        FreeList = Node->Next;
+        ReleasePages(Address, Order);
+    }
+}
+
+// NOTE(vak): Defers the release of a page table along with all of the
+// page tables below it.
+
+local void x64CollectPageTables(usize* FreeList, usize Address, usize Level)
+{
+    x64_page_table* Table = x64GetPageTable(Address);
+
+    if (Level > 0)
+    {
+        for (usize Index = 0; Index < 512; Index++)
+        {
+            u64 Entry = Table->Entries[Index];
+
+            if ((Entry & x64_PageFlag_Present) && !(Entry & x64_PageFlag_PageSize))
+                x64CollectPageTables(FreeList, Entry & x64_PageAddressMask, Level - 1);
+        }
+    }
+
+    x64DeferRelease(FreeList, Address, ArchGetPageSize());
+    CountPages(MemoryUsage_PageTables, -1);
+}
+
+local b32 x64IsPageTableEmpty(x64_page_table* Table)
+{
+    b32 Result = true;
+
+    for (usize Index = 0; Index < 512; Index++)
+    {
+        if (Table->Entries[Index] & x64_PageFlag_Present)
+        {
+            Result = false;
+            break;
+        }
+    }
+
+    return (Result);
+}
+
+local b32 x64MapRange(
+    x64_page_table* Table,
+    usize           Level,
+    x64_map_cursor* Cursor
+)
+{
+    b32 Result = true;
+
+    usize EntrySize = KB(4) << (9 * Level);
+    usize Index     = (Cursor->Virtual >> (12 + 9 * Level)) & 0x1FF;
+
+    for (; (Index < 512) && Cursor->Size; Index++)
+    {
+        // NOTE(vak): Use a leaf entry at this level if the range
+        // covers it entirely and the processor supports the size.
+
+        b32 Leaf = (
+            ArchIsPageSizeSupported(EntrySize) &&
+            ((Cursor->Physical | Cursor->Virtual) & (EntrySize - 1)) == 0 &&
+            (Cursor->Size >= EntrySize)
+        );
+
+        if (Leaf)
+        {
+            u64 Entry = Cursor->Physical | Cursor->Flags;
+
+            if (Level > 0)
+                Entry |= x64_PageFlag_PageSize;
 
-        "movq %%rsp, %%rcx\n"
-        "call %P0\n"
+            if (Cursor->PAT)
+                Entry |= (Level > 0) ? x64_PageFlag_PATLarge : x64_PageFlag_PAT;
 
-        // NOTE(vak): Pop registers
+            u64 Previous = Table->Entries[Index];
 
-        "popq %%r15\n"
-        "popq %%r14\n"
-        "popq %%r13\n"
-        "popq %%r12\n"
-        "popq %%r11\n"
-        "popq %%r10\n"
-        "popq %%r9\n"
-        "popq %%r8\n"
-        "popq %%rdi\n"
-        "popq %%rsi\n"
-        "popq %%rdx\n"
-        "popq %%rcx\n"
-        "popq %%rbx\n"
-        "popq %%rax\n"
-        "popq %%rbp\n"
+            if (Previous & x64_PageFlag_Present)
+            {
+                Cursor->Replaced = true;
 
-        // NOTE(vak): Pop interrupt number + error code
+                // NOTE(vak): A large page replaces a whole page table,
+                // which is no longer reachable.
 
-        "add $16, %%rsp\n"
+                if ((Level > 0) && !(Previous & x64_PageFlag_PageSize))
+                    x64CollectPageTables(&Cursor->FreeList, Previous & x64_PageAddressMask, Level - 1);
+            }
 
-        // NOTE(vak): Return from interrupt
+            Table->Entries[Index] = Entry;
 
-        "iretq\n"
+            Cursor->Physical += EntrySize;
+            Cursor->Virtual  += EntrySize;
+            Cursor->Size     -= EntrySize;
+        }
+        else
+        {
+            // NOTE(vak): Descend, and fill as many consecutive entries
+            // of the child table as the range covers.
 
-        :: "i"(x64InterruptDispatch)
-    );
+            x64_page_table* Child = x64LookupPageTable(Table, Index, EntrySize);
+
+            Result = Child && x64MapRange(Child, Level - 1, Cursor);
+
+            if (!Result)
+                break;
+        }
+    }
+
+    return (Result);
 }
 
-local void x64SetIDTEntry(
-    x64_idt* IDT,
-    u8       Index,
-    void*    Handler,
-    u8       GateType
+local b32 ArchMapRange(
+    arch_page_map* PageMap,
+    usize          PhysicalAddress,
+    usize          VirtualAddress,
+    usize          Size,
+    arch_map_flags Flags
 )
 {
-    u64 Address = (u64)Handler;
+    b32 Result = false;
 
-    x64_idt_entry* Entry = IDT->Entries + Index;
+    usize PageSize = ArchGetPageSize();
+    usize Levels   = x64PageMapState.PagingLevels;
 
-    Entry->Address0 = (Address & 0xFFFF);
-    Entry->CS       = 0x08;
-    Entry->IST      = 0;
-    Entry->Flags    = x64_GatePresent | GateType;
-    Entry->Address1 = (Address >> 16) & 0xFFFF;
-    Entry->Address2 = (Address >> 32) & 0xFFFFFFFF;
-    Entry->Reserved = 0;
-}
+    // NOTE(vak): Addresses have 48 bits with 4 levels and 57 bits with
+    // 5 levels, the bits above have to match the top one.
 
-local void ArchSetup(void)
-{
-    // NOTE(vak): Clear interrupts
+    usize Bits      = 12 + 9 * Levels;
+    usize Last      = VirtualAddress + (Size - 1);
+    b32   Canonical = (
+        ((usize)((s64)(VirtualAddress << (64 - Bits)) >> (64 - Bits)) == VirtualAddress) &&
+        ((usize)((s64)(Last           << (64 - Bits)) >> (64 - Bits)) == Last) &&
+        ((VirtualAddress >> (Bits - 1)) == (Last >> (Bits - 1)))
+    );
+
+    if ((PhysicalAddress | VirtualAddress | Size) & (PageSize - 1))
     {
-        __asm volatile ("cli");
+        SerialErrorf(Str("Misaligned mapping of 0x%p -> 0x%p (%usize bytes)."), VirtualAddress, PhysicalAddress, Size);
     }
-
-    // NOTE(vak): Setup serial port
+    else if (Size && !Canonical)
     {
-        x64OutByte(x64_COM1 + 3, 0x00); // NOTE(vak): Set DLAB to 0
-        x64OutByte(x64_COM1 + 1, 0x00); // NOTE(vak): Disable interrupts
+        SerialErrorf(Str("Non-canonical mapping of 0x%p (%usize bytes)."), VirtualAddress, Size);
+    }
+    else
+    {
+        x64_map_cursor Cursor =
+        {
+            .Physical = PhysicalAddress,
+            .Virtual  = VirtualAddress,
+            .Size     = Size,
+            .Flags    = x64GetPageFlags(Flags),
+            .PAT      = x64IsPATMapping(Flags),
+        };
 
-        x64OutByte(x64_COM1 + 3, 0x80); // NOTE(vak): Set DLAB to 1
+        Result = x64MapRange(x64GetPageTable(PageMap->Root), Levels - 1, &Cursor);
 
-        // NOTE(vak): Set divisor to 0x0003, which corresponds
-        // to a baud rate of 38400 baud.
-        x64OutByte(x64_COM1 + 0, 0x03);
-        x64OutByte(x64_COM1 + 1, 0x00);
+        if ((PageMap == &x64KernelPageMap) && Size)
+            x64SyncKernelRoot(VirtualAddress, Size);
 
-        // NOTE(vak): Initialize line control register
-        //     + Set data length to 8 bits
-        //     + Set stop bits to 1
-        //     + Set no parity bits
-        //     + Disable break
-        //     + Set DLAB to 0
-        x64OutByte(x64_COM1 + 3, 0x03);
+        if (!Result)
+            SerialErrorf(Str("Out of page tables mapping 0x%p -> 0x%p (%usize bytes)."), VirtualAddress, PhysicalAddress, Size);
 
-        // NOTE(vak): Initialize FIFO control register
-        //     + Enable FIFO
-        //     + Enable clearing for receive/transmit buffers,
-        //     + Set byte threshold to 14 byte.
-        x64OutByte(x64_COM1 + 2, 0xC7);
+        // NOTE(vak): Only translations that were present before can
+        // be cached in the TLB.
 
-        // NOTE(vak): Initialize modem control register
-        //     + Enable "Data Terminal Ready"
-        //     + Enable "Request To Send"
-        //     + Enable "Out 1"
-        //     + Enable "Out 2"
-        //     + Disable "Loop"
-        x64OutByte(x64_COM1 + 4, 0x0F);
+        if (Cursor.Replaced)
+            ArchInvalidateRange(PageMap, VirtualAddress, Size);
 
-        // NOTE(vak): UEFI can output garbage to the serial port,
-        // so print a couple of newlines to seperate from that.
+        x64ReleaseDeferred(Cursor.FreeList);
+    }
 
-        SerialPrintf(Str("\n\n"));
-        SerialInfof (Str("Initialized serial port COM1"));
+    return (Result);
+}
+
+local b32 ArchMapPage(
+    arch_page_map* PageMap,
+    usize          PhysicalAddress,
+    usize          VirtualAddress,
+    usize          PageSize
+)
+{
+    b32 Result = false;
+
+    if (!ArchIsPageSizeSupported(PageSize))
+    {
+        SerialErrorf(Str("Unsupported page size %usize."), PageSize);
+    }
+    else if ((PhysicalAddress | VirtualAddress) & (PageSize - 1))
+    {
+        SerialErrorf(Str("Misaligned %usize byte page at 0x%p -> 0x%p."), PageSize, VirtualAddress, PhysicalAddress);
+    }
+    else
+    {
+        Result = ArchMapRange(PageMap, PhysicalAddress, VirtualAddress, PageSize, ArchMapFlag_Write | ArchMapFlag_Execute);
     }
 
-    // NOTE(vak): Setup global descriptor table (GDT)
+    return (Result);
+}
+
+local void x64UnmapRange(
+    x64_page_table*   Table,
+    usize             Level,
+    x64_unmap_cursor* Cursor
+)
+{
+    usize EntrySize = KB(4) << (9 * Level);
+    usize Index     = (Cursor->Virtual >> (12 + 9 * Level)) & 0x1FF;
+
+    for (; (Index < 512) && Cursor->Size; Index++)
     {
-        persist x64_gdt_entry Entries[] =
+        u64 Entry = Table->Entries[Index];
+
+        usize Offset = Cursor->Virtual & (EntrySize - 1);
+        usize Step   = Minimum(EntrySize - Offset, Cursor->Size);
+
+        b32 Present = (Entry & x64_PageFlag_Present) != 0;
+        b32 Leaf    = (Level == 0) || (Entry & x64_PageFlag_PageSize);
+        b32 Whole   = (Step == EntrySize);
+
+        if (Present && Leaf && Whole)
         {
-            {0x0000, 0x0000, 0x00, 0x00, 0x00, 0x00}, // NOTE(vak): Null
-            {0x0000, 0x0000, 0x00, 0x9A, 0xA0, 0x00}, // NOTE(vak): Kernel code
-            {0x0000, 0x0000, 0x00, 0x92, 0xA0, 0x00}, // NOTE(vak): Kernel data
-        };
+            Table->Entries[Index] = 0;
 
-        x64_gdt_register GDTR =
+            if (Cursor->ReleaseFrames)
+            {
+                usize Address = Entry & x64_PageAddressMask & ~(u64)(EntrySize - 1);
+                x64DeferRelease(&Cursor->FreeList, Address, EntrySize);
+
+                Cursor->Released += EntrySize / ArchGetPageSize();
+            }
+        }
+        else if (Present)
         {
-            .Limit   = sizeof(Entries) - 1,
-            .Address = (u64)Entries,
-        };
+            // NOTE(vak): Descend into the page table, splitting a large
+            // page that is only partially unmapped. The child advances
+            // the cursor, and is released if nothing is left in it.
 
-        __asm volatile
-        (
-            // NOTE(vak): Load global descriptor table register (GDTR)
-            "    lgdtq %0\n"
+            x64_page_table* Child = x64LookupPageTable(Table, Index, EntrySize);
 
-            // NOTE(vak): Load data segment offset
-            "    movw $0x10, %%ax\n"
-            "    movw %%ax, %%es\n"
-            "    movw %%ax, %%ds\n"
-            "    movw %%ax, %%fs\n"
-            "    movw %%ax, %%gs\n"
-            "    movw %%ax, %%ss\n"
+            // NOTE(vak): Leaving part of a large page mapped would keep
+            // memory reachable that is about to be reused.
 
-            // NOTE(vak): Load code segment offset by performing a long
-            // jump, which pops the return address and the code segment
-            // offset off of the stack.
-            "    lea (DummyLabel), %%rax\n"
-            "    pushq $0x08\n" // NOTE(vak): Code segment offset
-            "    pushq %%rax\n" // NOTE(vak): Return address
-            "    lretq\n"
-            "DummyLabel:\n"
+            if (!Child)
+            {
+                SerialErrorf(Str("Out of page tables splitting the large page at 0x%p."), Cursor->Virtual);
+                x64Halt();
+            }
 
-            :: "m"(GDTR) : "rax"
-        );
+            usize Address = Table->Entries[Index] & x64_PageAddressMask;
 
-        SerialInfof(Str("Loaded GDT"));
-    }
+            x64UnmapRange(Child, Level - 1, Cursor);
 
-    // NOTE(vak): Setup interrupt descriptor table (IDT)
-    {
-        persist x64_idt IDT = {0};
-
-        // NOTE(vak): Fill in the first 32 interrupts, which are used
-        // by the processor to report faults, debug breaks, ...
-
-        x64SetIDTEntry(&IDT,  0, (void*)x64Interrupt0 , x64_GateType_Trap);
-        x64SetIDTEntry(&IDT,  1, (void*)x64Interrupt1 , x64_GateType_Trap);
-        x64SetIDTEntry(&IDT,  2, (void*)x64Interrupt2 , x64_GateType_Interrupt);
-        x64SetIDTEntry(&IDT,  3, (void*)x64Interrupt3 , x64_GateType_Trap);
-        x64SetIDTEntry(&IDT,  4, (void*)x64Interrupt4 , x64_GateType_Trap);
-        x64SetIDTEntry(&IDT,  5, (void*)x64Interrupt5 , x64_GateType_Trap);
-        x64SetIDTEntry(&IDT,  6, (void*)x64Interrupt6 , x64_GateType_Trap);
-        x64SetIDTEntry(&IDT,  7, (void*)x64Interrupt7 , x64_GateType_Trap);
-        x64SetIDTEntry(&IDT,  8, (void*)x64Interrupt8 , x64_GateType_Trap);
-        x64SetIDTEntry(&IDT,  9, (void*)x64Interrupt9 , x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 10, (void*)x64Interrupt10, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 11, (void*)x64Interrupt11, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 12, (void*)x64Interrupt12, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 13, (void*)x64Interrupt13, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 14, (void*)x64Interrupt14, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 15, (void*)x64Interrupt15, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 16, (void*)x64Interrupt16, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 17, (void*)x64Interrupt17, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 18, (void*)x64Interrupt18, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 19, (void*)x64Interrupt19, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 20, (void*)x64Interrupt20, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 21, (void*)x64Interrupt21, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 22, (void*)x64Interrupt22, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 23, (void*)x64Interrupt23, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 24, (void*)x64Interrupt24, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 25, (void*)x64Interrupt25, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 26, (void*)x64Interrupt26, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 27, (void*)x64Interrupt27, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 28, (void*)x64Interrupt28, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 29, (void*)x64Interrupt29, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 30, (void*)x64Interrupt30, x64_GateType_Trap);
-        x64SetIDTEntry(&IDT, 31, (void*)x64Interrupt31, x64_GateType_Trap);
+            // NOTE(vak): Tables below kernel root entries are shared by
+            // every page map, so they stay.
 
-        // NOTE(vak): Load IDT
+            b32 Shared = (Level + 1 == x64PageMapState.PagingLevels) && x64IsKernelRootIndex(Index);
 
-        x64_idt_register IDTR =
-        {
-            .Limit   = sizeof(IDT) - 1,
-            .Address = (usize)&IDT,
-        };
+            if (!Shared && x64IsPageTableEmpty(Child))
+            {
+                Table->Entries[Index] = 0;
+                x64DeferRelease(&Cursor->FreeList, Address, ArchGetPageSize());
+                CountPages(MemoryUsage_PageTables, -1);
+            }
 
-        __asm volatile
-        (
-            "lidt %0\n"
-            "sti\n"
-            :: "m"(IDTR)
-        );
+            continue;
+        }
 
-        SerialInfof(Str("Loaded IDT"));
+        Cursor->Virtual += Step;
+        Cursor->Size    -= Step;
     }
 }
 
-local void ArchWriteSerial(void* Buffer, usize Size)
+local usize ArchUnmapRange(
+    arch_page_map* PageMap,
+    usize          VirtualAddress,
+    usize          Size,
+    b32            ReleaseFrames
+)
 {
-    u8* Bytes = (u8*)Buffer;
+    usize Result = 0;
 
-    for (usize Index = 0; Index < Size; Index++)
-    {
-        // NOTE(vak): Wait for transmission buffer to be empty
+    usize PageSize = ArchGetPageSize();
 
-        for (;;)
+    if ((VirtualAddress | Size) & (PageSize - 1))
+    {
+        SerialErrorf(Str("Misaligned unmapping of 0x%p (%usize bytes)."), VirtualAddress, Size);
+    }
+    else if (Size)
+    {
+        x64_unmap_cursor Cursor =
         {
-            u8 LineStatus = x64InByte(x64_COM1 + 5);
-            if (LineStatus & 0x20)
-                break;
-        }
+            .Virtual       = VirtualAddress,
+            .Size          = Size,
+            .ReleaseFrames = ReleaseFrames,
+        };
 
-        // NOTE(vak): Transmit byte
+        usize Levels = x64PageMapState.PagingLevels;
 
-        x64OutByte(x64_COM1 + 0, Bytes[Index]);
+        x64UnmapRange(x64GetPageTable(PageMap->Root), Levels - 1, &Cursor);
+
+        ArchInvalidateRange(PageMap, VirtualAddress, Size);
+        x64ReleaseDeferred(Cursor.FreeList);
+
+        Result = Cursor.Released;
     }
+
+    return (Result);
 }
 
-local usize ArchGetPageSize(void)
+local void ArchUnmapPage(
+    arch_page_map* PageMap,
+    usize          VirtualAddress,
+    usize          PageSize
+)
 {
-    return KB(4);
+    if (!ArchIsPageSizeSupported(PageSize))
+    {
+        SerialErrorf(Str("Unsupported page size %usize."), PageSize);
+    }
+    else
+    {
+        ArchUnmapRange(PageMap, VirtualAddress, PageSize, false);
+    }
 }
 
-local arch_page_map* ArchNewPageMap(memory_map* MemoryMap)
+local void x64FlushAllContexts(void)
 {
-    arch_page_map* PageMap = ReservePage(
-        MemoryMap,
-        MemoryRegionKind_Usable
-    );
+    if (x64Features.INVPCID)
+    {
+        x64InvalidatePCID(x64_INVPCID_AllContexts, 0, 0);
+    }
+    else
+    {
+        // NOTE(vak): Toggling CR4.PGE flushes every TLB entry,
+        // including global ones and those of all PCIDs.
 
-    ZeroType(PageMap);
+        u64 CR4 = x64ReadCR4();
 
-    return (PageMap);
+        x64WriteCR4(CR4 ^ x64_CR4_PGE);
+        x64WriteCR4(CR4);
+    }
 }
 
-local arch_page_map* x64LookupPageTable(
-    memory_map*    MemoryMap,
-    arch_page_map* PageMap,
-    usize          Index
-)
+local void ArchUsePageMap(arch_page_map* PageMap)
 {
-    if (Index >= 512) return (0);
+    x64_page_map_state* State = &x64PageMapState;
+
+    u64 CR3 = PageMap->Root;
+
+    // NOTE(vak): Page maps are built for the selected number of paging
+    // levels, so the first switch away from the firmware's 4-level
+    // tables has to turn on LA57.
 
-    // NOTE(vak): Allocate a new page table if it doesn't exist.
+    if ((State->PagingLevels == 5) && !(x64ReadCR4() & x64_CR4_LA57))
+        x64SwitchToLA57(PageMap->Root);
 
-    if ((PageMap->Entries[Index] & x64_PageFlag_Present) == 0)
+    if (x64Features.PCID)
     {
-        arch_page_map* New = ArchNewPageMap(MemoryMap);
+        if (PageMap->PCIDGeneration == State->Generation)
+        {
+            // NOTE(vak): The page map still owns its PCID, so its
+            // TLB entries are kept.
+
+            CR3 |= PageMap->PCID | x64_CR3_NoFlush;
+        }
+        else
+        {
+            if (State->NextPCID == x64_PCIDCount)
+            {
+                State->Generation++;
+                State->NextPCID = 1;
 
-        u64 Flags   = x64_PageFlag_Present | x64_PageFlag_ReadWrite;
-        u64 Address = (u64)New;
+                x64FlushAllContexts();
+            }
 
-        PageMap->Entries[Index] = Address | Flags;
-    }
+            PageMap->PCID           = State->NextPCID++;
+            PageMap->PCIDGeneration = State->Generation;
 
-    // NOTE(vak): Retreive the page table address from the entry.
+            CR3 |= PageMap->PCID;
+        }
+    }
 
-    u64 Entry = PageMap->Entries[Index];
-    arch_page_map* Result = (arch_page_map*)(Entry & x64_PageAddressMask);
+    x64WriteCR3(CR3);
 
-    return (Result);
+    State->Current = PageMap;
 }
 
-local void ArchMapPage(
-    memory_map*    MemoryMap,
+local void ArchInvalidateRange(
     arch_page_map* PageMap,
-    usize          PhysicalAddress,
-    usize          VirtualAddress
+    usize          VirtualAddress,
+    usize          Size
 )
 {
-    // NOTE(vak): Page table entry indices
+    x64_page_map_state* State = &x64PageMapState;
 
-    usize IndexPML5 = (VirtualAddress >> 48) & 0x1FF;
-    usize IndexPML4 = (VirtualAddress >> 39) & 0x1FF;
-    usize IndexPDPT = (VirtualAddress >> 30) & 0x1FF;
-    usize IndexPDT  = (VirtualAddress >> 21) & 0x1FF;
-    usize IndexPT   = (VirtualAddress >> 12) & 0x1FF;
+    usize PageSize  = ArchGetPageSize();
+    usize PageCount = Align(Size, PageSize) / PageSize;
 
-    if (IndexPML5 > 0) return;
+    b32 Current = (State->Current == PageMap);
+    b32 Tagged  = x64Features.PCID && (PageMap->PCIDGeneration == State->Generation);
+
+    if (PageMap == &x64KernelPageMap)
+    {
+        // NOTE(vak): Kernel mappings are global. INVLPG drops global
+        // translations regardless of PCID, but INVPCID only does when
+        // flushing all contexts.
+
+        if (PageCount > x64_InvalidatePageLimit)
+        {
+            x64FlushAllContexts();
+        }
+        else
+        {
+            for (usize Index = 0; Index < PageCount; Index++)
+            {
+                x64InvalidatePage(VirtualAddress + Index * PageSize);
+            }
+        }
+    }
+    else if (Tagged && x64Features.INVPCID)
+    {
+        // NOTE(vak): Entries of any address space can be targeted
+        // through its PCID, whether it is active or not.
 
-    // NOTE(vak): Lookup page tables
+        if (PageCount > x64_InvalidatePageLimit)
+        {
+            x64InvalidatePCID(x64_INVPCID_SingleContext, PageMap->PCID, 0);
+        }
+        else
+        {
+            for (usize Index = 0; Index < PageCount; Index++)
+            {
+                x64InvalidatePCID(x64_INVPCID_Address, PageMap->PCID, VirtualAddress + Index * PageSize);
+            }
+        }
+    }
+    else if (Current)
+    {
+        if (PageCount > x64_InvalidatePageLimit)
+        {
+            // NOTE(vak): Reloading CR3 without the no-flush bit
+            // flushes the current address space.
 
-    arch_page_map* PML4 = PageMap;
-    arch_page_map* PDPT = x64LookupPageTable(MemoryMap, PML4, IndexPML4);
-    arch_page_map* PDT  = x64LookupPageTable(MemoryMap, PDPT, IndexPDPT);
-    arch_page_map* PT   = x64LookupPageTable(MemoryMap, PDT , IndexPDT );
+            u64 CR3 = PageMap->Root;
 
-    // NOTE(vak): Set corresponding page table entry
+            if (Tagged)
+                CR3 |= PageMap->PCID;
 
-    PT->Entries[IndexPT] = (
-        PhysicalAddress        |
-        x64_PageFlag_Present   |
-        x64_PageFlag_ReadWrite
-    );
-}
+            x64WriteCR3(CR3);
+        }
+        else
+        {
+            for (usize Index = 0; Index < PageCount; Index++)
+            {
+                x64InvalidatePage(VirtualAddress + Index * PageSize);
+            }
+        }
+    }
+    else if (Tagged)
+    {
+        // NOTE(vak): Without INVPCID there is no way to reach the TLB
+        // entries of an inactive address space, so give up its PCID.
+        // It gets a fresh one the next time it is used.
 
-local void ArchUsePageMap(arch_page_map* PageMap)
-{
-    __asm volatile
-    (
-        "mov %0, %%cr3\n"
-        :: "r"(PageMap)
-    );
+        PageMap->PCIDGeneration = 0;
+    }
 }
 
 // NOTE(vak): Defines an interrupt that doesn't push an error code
@@ -428,35 +2385,4 @@ local void ArchUsePageMap(arch_page_map* PageMap)
         ); \
     }
 
-DefineInterrupt ( 0)
-DefineInterrupt ( 1)
-DefineInterrupt ( 2)
-DefineInterrupt ( 3)
-DefineInterrupt ( 4)
-DefineInterrupt ( 5)
-DefineInterrupt ( 6)
-DefineInterrupt ( 7)
-DefineInterruptE( 8)
-DefineInterrupt ( 9)
-DefineInterruptE(10)
-DefineInterruptE(11)
-DefineInterruptE(12)
-DefineInterruptE(13)
-DefineInterruptE(14)
-DefineInterrupt (15)
-DefineInterrupt (16)
-DefineInterruptE(17)
-DefineInterrupt (18)
-DefineInterrupt (19)
-DefineInterrupt (20)
-DefineInterruptE(21)
-DefineInterrupt (22)
-DefineInterrupt (23)
-DefineInterrupt (24)
-DefineInterrupt (25)
-DefineInterrupt (26)
-DefineInterrupt (27)
-DefineInterrupt (28)
-DefineInterrupt (29)
-DefineInterrupt (30)
-DefineInterrupt (31)
+x64_InterruptVectors(DefineInterrupt, DefineInterruptE)
@@ -55,7 +55,7 @@ packed(typedef struct
 
 CTAssert(sizeof(x64_idt_register) == 10);
 
-packed(typedef struct
+struct arch_interrupt_frame
 {
     u64 R15;
     u64 R14;
@@ -75,7 +75,25 @@ packed(typedef struct
 
     u64 Vector;
     u64 ErrorCode;
-} x64_interrupt_frame)
+
+    // NOTE(vak): Pushed by the processor
+
+    u64 RIP;
+    u64 CS;
+    u64 RFLAGS;
+    u64 RSP;
+    u64 SS;
+};
+
+typedef struct
+{
+    arch_interrupt_handler* Handler;
+    void*                   Context;
+} x64_interrupt_entry;
+
+// NOTE(vak): Vectors below this are processor exceptions.
+
+#define x64_ExceptionCount (32)
 
 #define x64_PageFlag_Present        ((u64)(1) << 0)
 #define x64_PageFlag_ReadWrite      ((u64)(1) << 1)
@@ -83,51 +101,379 @@ packed(typedef struct
 #define x64_PageFlag_WriteThrough   ((u64)(1) << 3)
 #define x64_PageFlag_CacheDisable   ((u64)(1) << 4)
 #define x64_PageFlag_Accessed       ((u64)(1) << 5)
+#define x64_PageFlag_Dirty          ((u64)(1) << 6)
+#define x64_PageFlag_PageSize       ((u64)(1) << 7)
+#define x64_PageFlag_Global         ((u64)(1) << 8)
+#define x64_PageFlag_PAT            ((u64)(1) << 7)  // NOTE(vak): 4KB pages
+#define x64_PageFlag_PATLarge       ((u64)(1) << 12) // NOTE(vak): 2MB/1GB pages
 #define x64_PageFlag_ExecuteDisable ((u64)(1) << 63)
 
+#define x64_PageTableFlags (x64_PageFlag_Present | x64_PageFlag_ReadWrite | x64_PageFlag_User)
+
 #define x64_PageFlagsMask   ((u64)(0xFE00000000000FFF))
 #define x64_PageAddressMask ((u64)(0x01FFFFFFFFFFF000))
 
-packed(struct arch_page_map
+packed(typedef struct
 {
     u64 Entries[512];
-})
+} x64_page_table)
+
+CTAssert(sizeof(x64_page_table) == KB(4));
+
+// NOTE(vak): Process-context identifiers (PCIDs) tag TLB entries with
+// the address space they belong to, so switching CR3 doesn't have to
+// flush them. PCIDs are handed out in generations: once all of them
+// are used up, every context is flushed and a new generation starts,
+// which implicitly takes the PCIDs away from all page maps.
+
+#define x64_PCIDCount (4096)
+
+#define x64_CR3_NoFlush ((u64)(1) << 63)
+#define x64_CR4_PGE     ((u64)(1) << 7)
+#define x64_CR4_LA57    ((u64)(1) << 12)
+#define x64_CR4_PCIDE   ((u64)(1) << 17)
+
+#define x64_MSR_EFER    (0xC0000080)
+#define x64_EFER_NXE    ((u64)(1) << 11)
+
+#define x64_INVPCID_Address       (0)
+#define x64_INVPCID_SingleContext (1)
+#define x64_INVPCID_AllContexts   (2)
+
+// NOTE(vak): Invalidating more pages than this at once is done by
+// flushing the whole address space instead.
+
+#define x64_InvalidatePageLimit (32)
+
+// NOTE(vak): The direct map starts at the bottom of the higher half
+// and takes up half of it, which leaves room for other kernel ranges.
+// With 5-level paging the higher half is 512 times larger.
+
+#define x64_DirectMapBase   ((usize)(0xFFFF800000000000))
+#define x64_DirectMapSize   (TB(64))
+#define x64_DirectMapBase57 ((usize)(0xFF00000000000000))
+#define x64_DirectMapSize57 (TB(32768))
+
+// NOTE(vak): The kernel arena follows right after the direct map.
+
+#define x64_KernelArenaSize (TB(32))
+
+// NOTE(vak): 5-level paging (LA57)
+//
+// LA57 widens virtual addresses from 48 to 57 bits with a fifth table
+// level. It can only be turned on while paging is disabled, which in
+// turn requires leaving long mode. When the firmware didn't enable it
+// already, the kernel page map is built with five levels, and the first
+// switch to it goes through a trampoline that drops to compatibility
+// mode, turns paging off and back on with LA57, and returns to long
+// mode. The trampoline, its stack and the new root table have to be
+// identity mapped below 4GB. Define x64_EnableLA57 as 0 to stay with
+// 4-level paging.
 
-CTAssert(sizeof(arch_page_map) == KB(4));
+#if !defined(x64_EnableLA57)
+#  define x64_EnableLA57 (1)
+#endif
+
+#define x64_GDT_KernelCode   (0x08)
+#define x64_GDT_KernelData   (0x10)
+#define x64_GDT_KernelCode32 (0x18)
+#define x64_GDT_KernelData32 (0x20)
+#define x64_GDT_TSS          (0x28) // NOTE(vak): One per processor, 16 bytes each
+
+#define x64_GDTEntryCount    (5 + 2 * ArchMaxCPUCount)
+
+// NOTE(vak): Task state segment (TSS)
+//
+// In long mode, the TSS only holds the stacks the processor switches
+// to. An interrupt gate with an IST index always switches to that
+// stack, whatever state the current one is in, so exceptions that can
+// arrive on a broken or overflowing stack get stacks of their own. The
+// stacks have an unmapped guard page below them. An IST stack is reused
+// from the top every time, so a vector on one must not nest.
+
+packed(typedef struct
+{
+    u32 Reserved0;
+    u64 RSP[3];
+    u64 Reserved1;
+    u64 IST[7];
+    u64 Reserved2;
+    u16 Reserved3;
+    u16 IOMapBase;
+} x64_tss)
+
+CTAssert(sizeof(x64_tss) == 104);
+
+#define x64_TSSAccess (0x89) // NOTE(vak): Present, available 64-bit TSS
+
+#define x64_IST_DoubleFault  (1)
+#define x64_IST_NMI          (2)
+#define x64_IST_MachineCheck (3)
+#define x64_IST_Debug        (4)
+#define x64_ISTCount         (4)
+
+#define x64_ISTStackSize (KB(16))
+
+struct arch_page_map
+{
+    usize           Root; // NOTE(vak): Physical address of the PML4 or PML5
+
+    u64 PCIDGeneration;
+    u16 PCID;
+
+    arch_page_map*  Next; // NOTE(vak): Other page maps sharing the kernel half
+};
+
+// NOTE(vak): The upper half of every root table points to the tables of
+// the kernel page map, so all page maps share the kernel mappings below
+// the root. Root entries the kernel page map gains later are copied to
+// the others, and the tables they point to are never released. The
+// kernel image and its stack are identity mapped in the lower half, so
+// the root entries covering them are shared as well.
+
+#define x64_KernelRootIndex (256)
+
+typedef struct
+{
+    usize          PagingLevels;
+    usize          TablePool;    // NOTE(vak): Physical address
+    usize          TablePoolEnd;
+    u64            Generation;
+    u16            NextPCID;
+    arch_page_map* Current;
+    slab_cache*    PageMapCache;
+
+    spin_lock      PageMapLock;
+    arch_page_map* PageMaps;     // NOTE(vak): Every page map but the kernel's
+
+    usize          ImageRootIndex;
+    usize          StackRootIndex;
+} x64_page_map_state;
+
+typedef struct
+{
+    u64 PCID;
+    u64 Address;
+} x64_invpcid_descriptor;
+
+typedef struct
+{
+    usize Physical;
+    usize Virtual;
+    usize Size;
+    u64   Flags;
+    b32   PAT;
+    b32   Replaced;
+    usize FreeList;
+} x64_map_cursor;
+
+typedef struct
+{
+    usize Virtual;
+    usize Size;
+    b32   ReleaseFrames;
+    usize Released; // NOTE(vak): Pages
+    usize FreeList;
+} x64_unmap_cursor;
+
+// NOTE(vak): Page tables and frames that are no longer mapped are only
+// released once their translations have been invalidated. Until then
+// they are kept on a list that is threaded through the pages.
+
+typedef struct
+{
+    usize Next;
+    usize Size;
+} x64_free_node;
+
+// NOTE(vak): Page attribute table (PAT)
+//
+// A page's memory type is picked from the PAT by its PAT, PCD and PWT
+// bits. The first four entries match the power-on defaults, so that
+// mappings that don't set the PAT bit keep their meaning, and entry 4
+// is changed to write-combining.
+//
+//     Index  PAT PCD PWT  Type
+//     0      0   0   0    Write-back
+//     1      0   0   1    Write-through
+//     2      0   1   0    Uncached (UC-)
+//     3      0   1   1    Uncached
+//     4      1   0   0    Write-combining
+//     5      1   0   1    Write-protected
+//     6      1   1   0    Uncached (UC-)
+//     7      1   1   1    Uncached
+
+#define x64_MSR_PAT (0x0277)
+
+#define x64_PATValue ((u64)(0x0007050100070406))
 
 #define x64_COM1 (0x03F8) // NOTE(vak): Serial port
 
+// NOTE(vak): Legacy PIC (8259)
+//
+// The PICs are remapped away from the exception vectors and then masked
+// entirely, interrupts are delivered by the APICs instead. A masked PIC
+// can still raise a spurious IRQ 7 or 15, which are ignored.
+
+#define x64_PIC1Command (0x20)
+#define x64_PIC1Data    (0x21)
+#define x64_PIC2Command (0xA0)
+#define x64_PIC2Data    (0xA1)
+
+#define x64_PICVectorBase (0x20)
+
+// NOTE(vak): Local APIC
+//
+// Every processor has a local APIC, which delivers its interrupts and
+// sends interrupts to other processors. With x2APIC, its registers are
+// MSRs, which are cheaper to access than the memory mapped registers of
+// the xAPIC, and the interrupt command register is a single write.
+// x2APIC is used whenever the processor supports it.
+
+#define x64_MSR_APICBase         (0x001B)
+#define x64_APICBase_X2APIC      ((u64)(1) << 10)
+#define x64_APICBase_Enable      ((u64)(1) << 11)
+#define x64_APICBase_AddressMask ((u64)(0x000FFFFFFFFFF000))
+
+#define x64_MSR_X2APIC (0x0800) // NOTE(vak): Plus the register offset divided by 16
+
+#define x64_LAPIC_ID       (0x020)
+#define x64_LAPIC_Version  (0x030)
+#define x64_LAPIC_TPR      (0x080)
+#define x64_LAPIC_EOI      (0x0B0)
+#define x64_LAPIC_SVR      (0x0F0)
+#define x64_LAPIC_ESR      (0x280)
+#define x64_LAPIC_ICRLow   (0x300)
+#define x64_LAPIC_ICRHigh  (0x310)
+#define x64_LAPIC_LVTTimer (0x320)
+#define x64_LAPIC_LVTLINT0 (0x350)
+#define x64_LAPIC_LVTLINT1 (0x360)
+#define x64_LAPIC_LVTError (0x370)
+
+#define x64_LAPIC_SVREnable (1 << 8)
+#define x64_LVT_Masked      (1 << 16)
+#define x64_LVT_NMI         (0x4 << 8)
+#define x64_LVT_ActiveLow   (1 << 13)
+#define x64_ICR_Pending     (1 << 12)
+#define x64_ICR_Assert      (1 << 14)
+
+#define x64_APICErrorVector (0xFE)
+#define x64_SpuriousVector  (0xFF) // NOTE(vak): Low 4 bits have to be set on older processors
+
+typedef struct
+{
+    b32   X2APIC;
+    usize Registers; // NOTE(vak): Virtual address, xAPIC only
+} x64_lapic_state;
+
+// NOTE(vak): IOAPIC
+//
+// Registers are accessed indirectly, by writing the register index to
+// the select register and then accessing the window register, so every
+// IOAPIC has a lock around the pair. Each input has a 64-bit
+// redirection entry, which picks the vector and destination.
+
+#define x64_IOAPIC_Select  (0x00)
+#define x64_IOAPIC_Window  (0x10)
+
+#define x64_IOAPIC_ID          (0x00)
+#define x64_IOAPIC_Version     (0x01)
+#define x64_IOAPIC_Redirection (0x10) // NOTE(vak): Two registers per input
+
+#define x64_Redirection_NMI       ((u64)(0x4) << 8)
+#define x64_Redirection_ActiveLow ((u64)(1) << 13)
+#define x64_Redirection_Level     ((u64)(1) << 15)
+#define x64_Redirection_Masked    ((u64)(1) << 16)
+
+#define x64_Redirection_DestinationShift (56) // NOTE(vak): 8-bit APIC IDs only
+
+typedef struct
+{
+    spin_lock Lock;
+    usize     Registers; // NOTE(vak): Virtual address
+    u32       ID;
+    u32       GSIBase;
+    u32       InputCount;
+} x64_ioapic;
+
+// NOTE(vak): Message signalled interrupts, fixed delivery and edge
+// triggered. The destination is an 8-bit APIC ID.
+
+#define x64_MSI_Address          (0xFEE00000)
+#define x64_MSI_DestinationShift (12)
+
+typedef struct
+{
+    acpi_madt_info* MADT;
+
+    usize           IOAPICCount;
+    x64_ioapic      IOAPICs[ACPIMaxIOAPICCount];
+} x64_ioapic_state;
+
+typedef struct
+{
+    u32 EAX;
+    u32 EBX;
+    u32 ECX;
+    u32 EDX;
+} x64_cpuid;
+
+typedef struct
+{
+    b32 Pages1GB;
+    b32 PCID;
+    b32 INVPCID;
+    b32 PAT;
+    b32 GlobalPages;
+    b32 NoExecute;
+    b32 LA57;
+    b32 APIC;
+    b32 X2APIC;
+} x64_features;
+
+local naked void x64EnterLA57(u64 CR3);
+
 // NOTE(vak): Interrupts
+//
+// Every vector has its own entry stub, which pushes the vector and, for
+// the exceptions where the processor doesn't, a zero error code. The
+// vectors are listed once, with X for the ones without an error code
+// and XE for the ones with.
+
+#define x64_InterruptVectors(X, XE) \
+    X  (  0) X  (  1) X  (  2) X  (  3) X  (  4) X  (  5) X  (  6) X  (  7) \
+    XE (  8) X  (  9) XE ( 10) XE ( 11) XE ( 12) XE ( 13) XE ( 14) X  ( 15) \
+    X  ( 16) XE ( 17) X  ( 18) X  ( 19) X  ( 20) XE ( 21) X  ( 22) X  ( 23) \
+    X  ( 24) X  ( 25) X  ( 26) X  ( 27) X  ( 28) XE ( 29) XE ( 30) X  ( 31) \
+    X  ( 32) X  ( 33) X  ( 34) X  ( 35) X  ( 36) X  ( 37) X  ( 38) X  ( 39) \
+    X  ( 40) X  ( 41) X  ( 42) X  ( 43) X  ( 44) X  ( 45) X  ( 46) X  ( 47) \
+    X  ( 48) X  ( 49) X  ( 50) X  ( 51) X  ( 52) X  ( 53) X  ( 54) X  ( 55) \
+    X  ( 56) X  ( 57) X  ( 58) X  ( 59) X  ( 60) X  ( 61) X  ( 62) X  ( 63) \
+    X  ( 64) X  ( 65) X  ( 66) X  ( 67) X  ( 68) X  ( 69) X  ( 70) X  ( 71) \
+    X  ( 72) X  ( 73) X  ( 74) X  ( 75) X  ( 76) X  ( 77) X  ( 78) X  ( 79) \
+    X  ( 80) X  ( 81) X  ( 82) X  ( 83) X  ( 84) X  ( 85) X  ( 86) X  ( 87) \
+    X  ( 88) X  ( 89) X  ( 90) X  ( 91) X  ( 92) X  ( 93) X  ( 94) X  ( 95) \
+    X  ( 96) X  ( 97) X  ( 98) X  ( 99) X  (100) X  (101) X  (102) X  (103) \
+    X  (104) X  (105) X  (106) X  (107) X  (108) X  (109) X  (110) X  (111) \
+    X  (112) X  (113) X  (114) X  (115) X  (116) X  (117) X  (118) X  (119) \
+    X  (120) X  (121) X  (122) X  (123) X  (124) X  (125) X  (126) X  (127) \
+    X  (128) X  (129) X  (130) X  (131) X  (132) X  (133) X  (134) X  (135) \
+    X  (136) X  (137) X  (138) X  (139) X  (140) X  (141) X  (142) X  (143) \
+    X  (144) X  (145) X  (146) X  (147) X  (148) X  (149) X  (150) X  (151) \
+    X  (152) X  (153) X  (154) X  (155) X  (156) X  (157) X  (158) X  (159) \
+    X  (160) X  (161) X  (162) X  (163) X  (164) X  (165) X  (166) X  (167) \
+    X  (168) X  (169) X  (170) X  (171) X  (172) X  (173) X  (174) X  (175) \
+    X  (176) X  (177) X  (178) X  (179) X  (180) X  (181) X  (182) X  (183) \
+    X  (184) X  (185) X  (186) X  (187) X  (188) X  (189) X  (190) X  (191) \
+    X  (192) X  (193) X  (194) X  (195) X  (196) X  (197) X  (198) X  (199) \
+    X  (200) X  (201) X  (202) X  (203) X  (204) X  (205) X  (206) X  (207) \
+    X  (208) X  (209) X  (210) X  (211) X  (212) X  (213) X  (214) X  (215) \
+    X  (216) X  (217) X  (218) X  (219) X  (220) X  (221) X  (222) X  (223) \
+    X  (224) X  (225) X  (226) X  (227) X  (228) X  (229) X  (230) X  (231) \
+    X  (232) X  (233) X  (234) X  (235) X  (236) X  (237) X  (238) X  (239) \
+    X  (240) X  (241) X  (242) X  (243) X  (244) X  (245) X  (246) X  (247) \
+    X  (248) X  (249) X  (250) X  (251) X  (252) X  (253) X  (254) X  (255)
+
+#define x64_DeclareInterrupt(Vector) local naked void x64Interrupt##Vector(void);
 
-local naked void x64Interrupt0 (void);
-local naked void x64Interrupt1 (void);
-local naked void x64Interrupt2 (void);
-local naked void x64Interrupt3 (void);
-local naked void x64Interrupt4 (void);
-local naked void x64Interrupt5 (void);
-local naked void x64Interrupt6 (void);
-local naked void x64Interrupt7 (void);
-local naked void x64Interrupt8 (void);
-local naked void x64Interrupt9 (void);
-local naked void x64Interrupt10(void);
-local naked void x64Interrupt11(void);
-local naked void x64Interrupt12(void);
-local naked void x64Interrupt13(void);
-local naked void x64Interrupt14(void);
-local naked void x64Interrupt15(void);
-local naked void x64Interrupt16(void);
-local naked void x64Interrupt17(void);
-local naked void x64Interrupt18(void);
-local naked void x64Interrupt19(void);
-local naked void x64Interrupt20(void);
-local naked void x64Interrupt21(void);
-local naked void x64Interrupt22(void);
-local naked void x64Interrupt23(void);
-local naked void x64Interrupt24(void);
-local naked void x64Interrupt25(void);
-local naked void x64Interrupt26(void);
-local naked void x64Interrupt27(void);
-local naked void x64Interrupt28(void);
-local naked void x64Interrupt29(void);
-local naked void x64Interrupt30(void);
-local naked void x64Interrupt31(void);
+x64_InterruptVectors(x64_DeclareInterrupt, x64_DeclareInterrupt)
@@ -0,0 +1,126 @@
+local arch_map_flags DMAGetMapFlags(dma_flags Flags)
+{
+    arch_map_flags Result = ArchMapFlag_Write | ArchMapFlag_Global;
+
+    if (Flags & DMAFlag_Uncached)       Result |= ArchMapFlag_Uncached;
+    if (Flags & DMAFlag_WriteCombining) Result |= ArchMapFlag_WriteCombining;
+
+    return (Result);
+}
+
+local dma_buffer DMAAllocate(usize Size, usize Alignment, usize Boundary, dma_flags Flags)
+{
+    dma_buffer Result = {0};
+
+    usize PageSize = ArchGetPageSize();
+    usize Rounded  = Align(Size, PageSize);
+
+    // NOTE(vak): The block has to be large enough for the buffer and
+    // aligned enough for the device.
+
+    usize Order     = GetFrameOrder(Maximum(Rounded, Alignment));
+    usize BlockSize = PageSize << Order;
+
+    if (!Size || (Alignment & (Alignment - 1)) || (Boundary & (Boundary - 1)))
+    {
+        SerialErrorf(Str("Invalid DMA buffer of %usize bytes (alignment %usize, boundary %usize)."), Size, Alignment, Boundary);
+    }
+    else if (Boundary && (Boundary < Rounded))
+    {
+        SerialErrorf(Str("DMA buffer of %usize bytes can't fit within a %usize byte boundary."), Size, Boundary);
+    }
+    else if (Order >= FrameOrderCount)
+    {
+        SerialErrorf(Str("DMA buffer of %usize bytes is too large."), Size);
+    }
+    else
+    {
+        // NOTE(vak): A boundary smaller than the block, because of the
+        // rounding, is still met by the part that is kept.
+
+        usize Address = 0;
+
+        b32 Huge = (
+            !(Flags & DMAFlag_Below4GB) &&
+            (Rounded == BlockSize) &&
+            (BlockSize > PageSize) &&
+            ArchIsPageSizeSupported(BlockSize)
+        );
+
+        Flags &= ~DMAFlag_HugePage;
+
+        if (Huge)
+        {
+            Address = ReserveHugePage(BlockSize);
+
+            if (Address)
+                Flags |= DMAFlag_HugePage;
+        }
+        else if (Flags & DMAFlag_Below4GB)
+        {
+            Address = ReservePagesBelow(Order, GB(4));
+        }
+        else
+        {
+            Address = ReservePages(Order);
+        }
+
+        if (Address)
+        {
+            if (Rounded < BlockSize)
+                ReleaseFrameRange(Address + Rounded, Address + BlockSize);
+
+            if (!(Flags & DMAFlag_HugePage))
+                CountPages(MemoryUsage_DMA, Rounded / PageSize);
+
+            Result.Virtual  = PhysicalToVirtual(Address);
+            Result.Physical = Address;
+            Result.Size     = Rounded;
+            Result.Flags    = Flags;
+
+            if (Flags & (DMAFlag_Uncached | DMAFlag_WriteCombining))
+            {
+                // NOTE(vak): Nothing may be left in the caches once the
+                // mapping isn't cached anymore, or it would be written
+                // back over what the device put there.
+
+                if (ArchMapRange(ArchGetKernelPageMap(), Address, (usize)Result.Virtual, Rounded, DMAGetMapFlags(Flags)))
+                {
+                    ArchFlushCache(Result.Virtual, Rounded);
+                }
+                else
+                {
+                    DMAFree(&Result);
+                }
+            }
+
+            if (Result.Virtual)
+                ZeroMemory(Result.Virtual, Rounded);
+        }
+    }
+
+    return (Result);
+}
+
+local void DMAFree(dma_buffer* Buffer)
+{
+    if (Buffer->Virtual)
+    {
+        if (Buffer->Flags & (DMAFlag_Uncached | DMAFlag_WriteCombining))
+        {
+            ArchMapRange(ArchGetKernelPageMap(), Buffer->Physical, (usize)Buffer->Virtual, Buffer->Size, DMAGetMapFlags(0));
+        }
+
+        if (Buffer->Flags & DMAFlag_HugePage)
+        {
+            ReleaseHugePage(Buffer->Physical, Buffer->Size);
+        }
+        else
+        {
+            ReleaseFrameRange(Buffer->Physical, Buffer->Physical + Buffer->Size);
+            CountPages(MemoryUsage_DMA, -(ssize)(Buffer->Size / ArchGetPageSize()));
+        }
+
+        ZeroType(Buffer);
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+// NOTE(vak): DMA buffers
+//
+// Buffers that devices access directly have to be physically contiguous,
+// so they are taken from the frame allocator as a single block, aligned
+// to the block size. That alignment is what satisfies both the Alignment
+// and the Boundary constraint: a block never crosses a boundary that is
+// at least as large as itself. The pages past the requested size are
+// given back right away.
+//
+// Buffers are reached through the direct map. If a cache type other
+// than write-back is asked for, the direct map of the buffer is remapped
+// with it, and restored when the buffer is freed. Buffers are zeroed.
+//
+// Buffers that are exactly one huge page, such as large descriptor rings,
+// come from the huge page pools, which were set aside before memory had
+// a chance to fragment. They are counted as huge pages rather than DMA.
+
+typedef usize dma_flags;
+enum
+{
+    DMAFlag_Below4GB       = (1 << 0), // NOTE(vak): For devices with 32-bit addressing
+    DMAFlag_Uncached       = (1 << 1),
+    DMAFlag_WriteCombining = (1 << 2),
+
+    DMAFlag_HugePage       = (1 << 3), // NOTE(vak): Set by DMAAllocate, see below
+};
+
+typedef struct
+{
+    void*     Virtual;  // NOTE(vak): 0 if the allocation failed
+    usize     Physical;
+    usize     Size;     // NOTE(vak): Rounded up to pages
+    dma_flags Flags;
+} dma_buffer;
+
+// NOTE(vak): Alignment and Boundary have to be powers of 2, or 0 for no
+// constraint. The buffer won't cross a multiple of Boundary.
+
+local dma_buffer DMAAllocate(usize Size, usize Alignment, usize Boundary, dma_flags Flags);
+local void       DMAFree(dma_buffer* Buffer);
@@ -0,0 +1,111 @@
+local kernel_heap KernelHeap = {0};
+
+local void SetupKernelHeap(void)
+{
+    kernel_heap* Heap = &KernelHeap;
+
+    // NOTE(vak): Powers of 2 with a class halfway between them, which
+    // keeps the internal waste under a third.
+
+    persist usize Sizes[KernelHeapClassCount] =
+    {
+        16, 32, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+    };
+
+    persist string Names[KernelHeapClassCount] =
+    {
+        ImmStr("heap-16"),  ImmStr("heap-32"),  ImmStr("heap-64"),  ImmStr("heap-96"),
+        ImmStr("heap-128"), ImmStr("heap-192"), ImmStr("heap-256"), ImmStr("heap-384"),
+        ImmStr("heap-512"), ImmStr("heap-768"), ImmStr("heap-1024"), ImmStr("heap-1536"),
+        ImmStr("heap-2048"),
+    };
+
+    CTAssert(ArrayCount(Sizes) == KernelHeapClassCount);
+
+    b32 Ready = true;
+
+    for (usize Class = 0; Class < KernelHeapClassCount; Class++)
+    {
+        // NOTE(vak): Objects are aligned to the largest power of 2 that
+        // divides their size, up to a cache line.
+
+        usize Alignment = Minimum(Sizes[Class] & (~Sizes[Class] + 1), SlabColorSize);
+
+        Heap->Caches[Class] = CreateSlabCache(Names[Class], Sizes[Class], Alignment, 0);
+
+        if (!Heap->Caches[Class])
+            Ready = false;
+    }
+
+    // NOTE(vak): Map every multiple of the granule to its size class,
+    // so that finding the class is a single lookup.
+
+    usize Class = 0;
+
+    for (usize Index = 0; Index < ArrayCount(Heap->ClassIndices); Index++)
+    {
+        while (Sizes[Class] < Index * KernelHeapGranule)
+            Class++;
+
+        Heap->ClassIndices[Index] = (u8)Class;
+    }
+
+    Heap->Ready = Ready;
+
+    if (!Ready)
+    {
+        SerialErrorf(Str("Unable to set up the kernel heap."));
+    }
+}
+
+local void* KernelAllocate(usize Size)
+{
+    kernel_heap* Heap = &KernelHeap;
+
+    void* Result = 0;
+
+    if (!Heap->Ready)
+    {
+        // NOTE(vak): Nothing to allocate from yet.
+    }
+    else if (Size <= KernelHeapMaxSmall)
+    {
+        usize Class = Heap->ClassIndices[(Size + KernelHeapGranule - 1) / KernelHeapGranule];
+        Result = SlabAllocate(Heap->Caches[Class]);
+    }
+    else
+    {
+        usize Order   = GetFrameOrder(Size);
+        usize Address = ReservePages(Order);
+
+        if (Address)
+        {
+            Result = PhysicalToVirtual(Address);
+            CountPages(MemoryUsage_Heap, (ssize)(1) << Order);
+        }
+    }
+
+    return (Result);
+}
+
+local void KernelFree(void* Pointer, usize Size)
+{
+    kernel_heap* Heap = &KernelHeap;
+
+    if (!Pointer)
+    {
+        // NOTE(vak): Freeing nothing is fine.
+    }
+    else if (Size <= KernelHeapMaxSmall)
+    {
+        usize Class = Heap->ClassIndices[(Size + KernelHeapGranule - 1) / KernelHeapGranule];
+        SlabFree(Heap->Caches[Class], Pointer);
+    }
+    else
+    {
+        usize Order = GetFrameOrder(Size);
+
+        ReleasePages(VirtualToPhysical(Pointer), Order);
+        CountPages(MemoryUsage_Heap, -((ssize)(1) << Order));
+    }
+}
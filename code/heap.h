@@ -0,0 +1,30 @@
+#pragma once
+
+// NOTE(vak): Kernel heap
+//
+// General purpose allocations. Sizes up to KernelHeapMaxSmall are rounded
+// up to a size class, each of which is backed by a slab cache, so that
+// the fast path only touches the current processor's magazine. Larger
+// sizes are rounded up to a power of 2 number of pages, which are taken
+// straight from the frame allocator. Memory isn't zeroed, and the size
+// of an allocation has to be passed back to KernelFree.
+//
+// Like the slab allocator, the heap can only be used once the direct
+// map is active. Until SetupKernelHeap is called, KernelAllocate quietly
+// returns 0.
+
+#define KernelHeapClassCount (13)
+#define KernelHeapMaxSmall   (KB(2))
+#define KernelHeapGranule    (16)
+
+typedef struct
+{
+    b32         Ready;
+    slab_cache* Caches[KernelHeapClassCount];
+    u8          ClassIndices[KernelHeapMaxSmall / KernelHeapGranule + 1];
+} kernel_heap;
+
+local void  SetupKernelHeap(void);
+
+local void* KernelAllocate(usize Size);
+local void  KernelFree(void* Pointer, usize Size);
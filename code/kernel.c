@@ -1,35 +1,104 @@
-
 local void KernelEntry(memory_map* MemoryMap, acpi_rsdp* RSDP)
 {
     ArchSetup();
 
+    SetupFrameAllocator(MemoryMap);
+
+    // NOTE(vak): The kernel page map was built by the bootloader.
+
+    arch_page_map* PageMap = ArchGetKernelPageMap();
+
+    ArchUsePageMap(PageMap);
+    UseDirectMap();
+
+    SetupHugePagePools();
+    SetupKernelHeap();
+    SetupKernelArena();
+
+    ArchSetupInterruptStacks();
+    ArchSetupInterruptController();
+
+    SetupKernelAddressSpace(PageMap);
+
+    SerialInfof(Str("Switched to the kernel page map."));
+
+    // NOTE(vak): The memory map may have been allocated after the page
+    // map was built, so it's only reachable through the direct map.
+
+    MemoryMap->Regions = (memory_region*)PhysicalToVirtual((usize)MemoryMap->Regions);
+
+    RSDP = (acpi_rsdp*)PhysicalToVirtual((usize)RSDP);
+
     SerialDebugf(Str("ACPI RSDP Address: 0x%p"), RSDP);
 
     ACPIValidateRSDP(RSDP);
 
-    acpi_description_header* MCFG = ACPIFindTableAddress(RSDP, FourCC('M', 'C', 'F', 'G'));
+    acpi_mcfg* MCFG = (acpi_mcfg*)ACPIFindTableAddress(RSDP, FourCC('M', 'C', 'F', 'G'));
     if (!MCFG)
     {
         SerialErrorf(Str("Cannot find ACPI MCFG table."));
     }
+    else
+    {
+        // NOTE(vak): Map the PCIe configuration space uncached into
+        // the direct map, so that it's reachable with PhysicalToVirtual.
 
-    arch_page_map* PageMap = ArchNewPageMap(MemoryMap);
+        for (usize Index = 0; Index < ACPIGetMCFGCount(MCFG); Index++)
+        {
+            acpi_mcfg_allocation* Allocation = ACPIGetMCFGAllocation(MCFG, Index);
 
-    for (
-        usize Address = 0;
-        Address < GB(4);
-        Address += ArchGetPageSize()
-    )
+            usize Start = Allocation->BaseAddress + ((usize)(Allocation->StartBus) << 20);
+            usize End   = Allocation->BaseAddress + ((usize)(Allocation->EndBus + 1) << 20);
+
+            ArchMapRange(
+                PageMap,
+                Start,
+                ArchGetDirectMapBase() + Start,
+                End - Start,
+                ArchMapFlag_Write | ArchMapFlag_Uncached | ArchMapFlag_Global
+            );
+
+            PCIAddSegment(Allocation->SegmentGroup, Allocation->StartBus, Allocation->EndBus, Allocation->BaseAddress);
+
+            SerialInfof(Str("PCIe segment %u16: buses %u8-%u8 at 0x%p"), Allocation->SegmentGroup, Allocation->StartBus, Allocation->EndBus, Start);
+        }
+    }
+
+    acpi_madt* MADT = (acpi_madt*)ACPIFindTableAddress(RSDP, FourCC('A', 'P', 'I', 'C'));
+    if (!MADT)
+    {
+        SerialErrorf(Str("Cannot find ACPI MADT table."));
+    }
+    else
     {
-        usize Physical = Address;
-        usize Virtual  = Address;
+        // NOTE(vak): Routing keeps referring to the parsed table, so
+        // it is never freed.
 
-        ArchMapPage(MemoryMap, PageMap, Physical, Virtual);
+        acpi_madt_info* MADTInfo = (acpi_madt_info*)KernelAllocate(sizeof(acpi_madt_info));
+
+        if (!MADTInfo)
+        {
+            SerialErrorf(Str("Unable to allocate the parsed MADT."));
+        }
+        else
+        {
+            ZeroType(MADTInfo);
+
+            ACPIParseMADT(MADT, MADTInfo);
+            ArchSetupInterruptRouting(MADTInfo);
+        }
     }
 
-    ArchUsePageMap(PageMap);
+    ReclaimBootMemory(PageMap, MemoryMap);
 
-    SerialInfof(Str("Mapped first 4GB of memory."));
+    DumpMemoryStats();
 
-    for (;;);
+    // NOTE(vak): Idle loop, which does background work until there is
+    // none left.
+
+    for (;;)
+    {
+        if (!FillZeroedPagePool())
+            ArchWaitForInterrupt();
+    }
 }
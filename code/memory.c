@@ -1,32 +1,1218 @@
+local frame_allocator FrameAllocator = {0};
+local frame_cache     FrameCaches[ArchMaxCPUCount] = {0};
+local zero_page_pool  ZeroPagePool = {0};
+local huge_page_pool  HugePagePools[HugePagePoolCount] = {0};
+local usize           MemoryUsageCounts[MemoryUsage_COUNT] = {0};
 
-local void* ReservePage(memory_map* MemoryMap, memory_region_kind Kind)
+local usize DirectMapOffset = 0;
+
+local void* PhysicalToVirtual(usize PhysicalAddress)
+{
+    void* Result = (void*)(PhysicalAddress + DirectMapOffset);
+    return (Result);
+}
+
+local usize VirtualToPhysical(void* VirtualAddress)
+{
+    usize Result = (usize)VirtualAddress - DirectMapOffset;
+    return (Result);
+}
+
+local frame_node* FrameGetNode(usize Address)
+{
+    frame_node* Result = (frame_node*)PhysicalToVirtual(Address);
+    return (Result);
+}
+
+local u64* FrameGetBitmap(usize Order)
+{
+    u64* Result = (u64*)PhysicalToVirtual(FrameAllocator.Bitmaps[Order]);
+    return (Result);
+}
+
+local b32 FrameIsFree(usize Index, usize Order)
+{
+    usize Bit = Index >> Order;
+    u64* Bitmap = FrameGetBitmap(Order);
+
+    b32 Result = (Bitmap[Bit / 64] >> (Bit % 64)) & 1;
+    return (Result);
+}
+
+local void FramePush(usize Address, usize Order)
+{
+    frame_allocator* Allocator = &FrameAllocator;
+
+    usize Index = (Address - Allocator->BaseAddress) / ArchGetPageSize();
+    usize Bit   = Index >> Order;
+
+    frame_node* Node = FrameGetNode(Address);
+    Node->Next = Allocator->FreeLists[Order];
+    Node->Prev = 0;
+
+    if (Node->Next)
+        FrameGetNode(Node->Next)->Prev = Address;
+
+    Allocator->FreeLists[Order] = Address;
+    Allocator->FreeCounts[Order]++;
+
+    FrameGetBitmap(Order)[Bit / 64] |= ((u64)(1) << (Bit % 64));
+}
+
+local void FrameRemove(usize Address, usize Order)
+{
+    frame_allocator* Allocator = &FrameAllocator;
+
+    usize Index = (Address - Allocator->BaseAddress) / ArchGetPageSize();
+    usize Bit   = Index >> Order;
+
+    frame_node* Node = FrameGetNode(Address);
+
+    if (Node->Prev)
+        FrameGetNode(Node->Prev)->Next = Node->Next;
+    else
+        Allocator->FreeLists[Order] = Node->Next;
+
+    if (Node->Next)
+        FrameGetNode(Node->Next)->Prev = Node->Prev;
+
+    Allocator->FreeCounts[Order]--;
+
+    FrameGetBitmap(Order)[Bit / 64] &= ~((u64)(1) << (Bit % 64));
+}
+
+// NOTE(vak): Takes a free block off its list and splits it down to
+// Order, returning the upper halves to their lists.
+
+// NOTE(vak): The watermark counts the pages in the caches as free, the
+// same as GetMemoryStats. The caches are changed without the allocator
+// lock, so both counts are read atomically, which is good enough for a
+// statistic.
+
+local void FrameUpdateWatermark(void)
+{
+    frame_allocator* Allocator = &FrameAllocator;
+
+    usize Free   = __atomic_load_n(&Allocator->FreePageCount, __ATOMIC_RELAXED) + __atomic_load_n(&Allocator->CachedPageCount, __ATOMIC_RELAXED);
+    usize Lowest = __atomic_load_n(&Allocator->LowestFreePageCount, __ATOMIC_RELAXED);
+
+    while ((Free < Lowest) && !__atomic_compare_exchange_n(&Allocator->LowestFreePageCount, &Lowest, Free, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+local void FrameTake(usize Address, usize Current, usize Order)
+{
+    frame_allocator* Allocator = &FrameAllocator;
+
+    FrameRemove(Address, Current);
+
+    while (Current > Order)
+    {
+        Current--;
+        FramePush(Address + (ArchGetPageSize() << Current), Current);
+    }
+
+    Allocator->FreePageCount -= (usize)(1) << Order;
+
+    FrameUpdateWatermark();
+}
+
+local usize FrameReserve(usize Order)
+{
+    frame_allocator* Allocator = &FrameAllocator;
+
+    usize Result = 0;
+
+    if (Order < FrameOrderCount)
+    {
+        // NOTE(vak): Find the smallest free block that fits.
+
+        usize Current = Order;
+        while ((Current < FrameOrderCount) && !Allocator->FreeLists[Current])
+            Current++;
+
+        if (Current < FrameOrderCount)
+        {
+            Result = Allocator->FreeLists[Current];
+            FrameTake(Result, Current, Order);
+        }
+    }
+
+    return (Result);
+}
+
+// NOTE(vak): Like FrameReserve, but only considers blocks that end at or
+// below Limit. Free lists aren't sorted, so this walks them.
+
+local usize FrameReserveBelow(usize Order, usize Limit)
+{
+    frame_allocator* Allocator = &FrameAllocator;
+
+    usize Result = 0;
+    usize Size   = ArchGetPageSize() << Order;
+
+    for (usize Current = Order; !Result && (Current < FrameOrderCount); Current++)
+    {
+        for (usize Address = Allocator->FreeLists[Current]; Address; Address = FrameGetNode(Address)->Next)
+        {
+            // NOTE(vak): Splitting keeps the lowest part of the block.
+
+            if ((Address < Limit) && (Limit - Address >= Size))
+            {
+                Result = Address;
+                FrameTake(Result, Current, Order);
+                break;
+            }
+        }
+    }
+
+    return (Result);
+}
+
+local b32 FrameIsValidBlock(usize Address, usize Order)
+{
+    frame_allocator* Allocator = &FrameAllocator;
+
+    usize PageSize = ArchGetPageSize();
+    usize Index    = (Address - Allocator->BaseAddress) / PageSize;
+
+    b32 Result = (
+        (Address >= Allocator->BaseAddress) &&
+        (Order < FrameOrderCount) &&
+        (Index < Allocator->PageCount) &&
+        !(Index & (((usize)(1) << Order) - 1)) &&
+        !(Address & (PageSize - 1))
+    );
+
+    if (!Result)
+    {
+        SerialErrorf(Str("Invalid page release at 0x%p (order %usize)."), Address, Order);
+    }
+
+    return (Result);
+}
+
+local void FrameRelease(usize Address, usize Order)
+{
+    frame_allocator* Allocator = &FrameAllocator;
+
+    usize PageSize = ArchGetPageSize();
+
+    if (!FrameIsValidBlock(Address, Order))
+        return;
+
+    usize Index = (Address - Allocator->BaseAddress) / PageSize;
+
+    Allocator->FreePageCount += (usize)(1) << Order;
+
+    // NOTE(vak): Merge with the buddy for as long as it is free.
+
+    while (Order + 1 < FrameOrderCount)
+    {
+        usize Buddy = Index ^ ((usize)(1) << Order);
+
+        if (!FrameIsFree(Buddy, Order))
+            break;
+
+        FrameRemove(Allocator->BaseAddress + Buddy * PageSize, Order);
+
+        Index &= ~((usize)(1) << Order);
+        Order++;
+    }
+
+    FramePush(Allocator->BaseAddress + Index * PageSize, Order);
+}
+
+// NOTE(vak): The allocator lock is only ever taken with interrupts
+// disabled, so that an interrupt handler can't deadlock against the
+// code it interrupted.
+
+local b32 FrameLock(void)
+{
+    b32 Enabled = ArchDisableInterrupts();
+    AcquireLock(&FrameAllocator.Lock);
+
+    return (Enabled);
+}
+
+local void FrameUnlock(b32 Enabled)
+{
+    ReleaseLock(&FrameAllocator.Lock);
+    ArchRestoreInterrupts(Enabled);
+}
+
+local void NormalizeMemoryMap(memory_map* MemoryMap)
+{
+    memory_region* Regions  = MemoryMap->Regions;
+    usize          PageSize = ArchGetPageSize();
+
+    // NOTE(vak): Insertion sort, firmware memory maps are short and
+    // mostly sorted already.
+
+    for (usize Index = 1; Index < MemoryMap->RegionCount; Index++)
+    {
+        memory_region Region = Regions[Index];
+        usize         Slot   = Index;
+
+        while ((Slot > 0) && (Regions[Slot - 1].BaseAddress > Region.BaseAddress))
+        {
+            Regions[Slot] = Regions[Slot - 1];
+            Slot--;
+        }
+
+        Regions[Slot] = Region;
+    }
+
+    usize Count  = 0;
+    usize Usable = 0;
+
+    for (usize Index = 0; Index < MemoryMap->RegionCount; Index++)
+    {
+        memory_region* Region = Regions + Index;
+        memory_region* Last   = (Count) ? (Regions + Count - 1) : (0);
+
+        if (Region->PageCount == 0)
+            continue;
+
+        b32 Adjacent = (
+            Last &&
+            (Last->Kind == Region->Kind) &&
+            (Last->BaseAddress + Last->PageCount * PageSize == Region->BaseAddress)
+        );
+
+        if (Adjacent)
+        {
+            Last->PageCount += Region->PageCount;
+        }
+        else
+        {
+            Regions[Count++] = *Region;
+        }
+
+        if (Region->Kind == MemoryRegionKind_Usable)
+            Usable += Region->PageCount;
+    }
+
+    MemoryMap->RegionCount     = Count;
+    MemoryMap->UsablePageCount = Usable;
+}
+
+// NOTE(vak): Releases a range into the allocator as the largest aligned
+// blocks that fit. Page 0 is never handed out, so that an address of 0
+// can mean "no page".
+
+local void ReleaseFrameRange(usize Address, usize End)
+{
+    frame_allocator* Allocator = &FrameAllocator;
+
+    usize PageSize = ArchGetPageSize();
+
+    if (Address == 0)
+        Address += PageSize;
+
+    while (Address < End)
+    {
+        usize PageIndex = (Address - Allocator->BaseAddress) / PageSize;
+        usize Order     = FrameOrderCount - 1;
+
+        for (;;)
+        {
+            usize BlockPages = (usize)(1) << Order;
+
+            b32 Aligned = (PageIndex & (BlockPages - 1)) == 0;
+            b32 Fits    = (Address + BlockPages * PageSize) <= End;
+
+            if ((Aligned && Fits) || (Order == 0))
+                break;
+
+            Order--;
+        }
+
+        b32 Enabled = FrameLock();
+        FrameRelease(Address, Order);
+        FrameUnlock(Enabled);
+
+        Address += PageSize << Order;
+    }
+}
+
+local void SetupFrameAllocator(memory_map* MemoryMap)
+{
+    frame_allocator* Allocator = &FrameAllocator;
+
+    usize PageSize  = ArchGetPageSize();
+    usize BlockSize = PageSize << (FrameOrderCount - 1);
+
+    // NOTE(vak): Find the span of usable physical memory, rounded out
+    // to the largest block size so that every order divides it evenly.
+    // Boot services memory is included, so that it can be reclaimed
+    // later on.
+
+    usize Lowest  = 0;
+    usize Highest = 0;
+    b32   Found   = false;
+
+    for (usize Index = 0; Index < MemoryMap->RegionCount; Index++)
+    {
+        memory_region* Region = MemoryMap->Regions + Index;
+
+        b32 Usable = (
+            (Region->Kind == MemoryRegionKind_Usable) ||
+            (Region->Kind == MemoryRegionKind_Reclaimable)
+        );
+
+        if (!Usable || (Region->PageCount == 0))
+            continue;
+
+        usize Start = Region->BaseAddress;
+        usize End   = Region->BaseAddress + Region->PageCount * PageSize;
+
+        if (!Found || (Start < Lowest )) Lowest  = Start;
+        if (!Found || (End   > Highest)) Highest = End;
+
+        Found = true;
+    }
+
+    if (!Found)
+    {
+        SerialErrorf(Str("No usable memory for the frame allocator."));
+        return;
+    }
+
+    Allocator->BaseAddress = Lowest & ~(BlockSize - 1);
+    Allocator->PageCount   = Align(Highest - Allocator->BaseAddress, BlockSize) / PageSize;
+
+    // NOTE(vak): Carve the free bitmaps out of the smallest usable
+    // region that is large enough to hold them, which leaves the large
+    // regions whole.
+
+    usize MetadataSize = 0;
+
+    for (usize Order = 0; Order < FrameOrderCount; Order++)
+    {
+        usize BitCount = Allocator->PageCount >> Order;
+        MetadataSize += Align(BitCount, 64) / 8;
+    }
+
+    usize MetadataPages = Align(MetadataSize, PageSize) / PageSize;
+    usize Metadata      = 0;
+
+    memory_region* Smallest = 0;
+
+    for (usize Index = 0; Index < MemoryMap->RegionCount; Index++)
+    {
+        memory_region* Region = MemoryMap->Regions + Index;
+
+        b32 Fits = (
+            (Region->Kind == MemoryRegionKind_Usable) &&
+            (Region->PageCount >= MetadataPages)
+        );
+
+        if (Fits && (!Smallest || (Region->PageCount < Smallest->PageCount)))
+            Smallest = Region;
+    }
+
+    // NOTE(vak): The region may start at page 0, so the address can't
+    // tell whether one was found.
+
+    if (!Smallest)
+    {
+        SerialErrorf(Str("Unable to reserve %usize pages for the frame allocator."), MetadataPages);
+        return;
+    }
+
+    Metadata = Smallest->BaseAddress;
+
+    Smallest->BaseAddress += MetadataPages * PageSize;
+    Smallest->PageCount   -= MetadataPages;
+
+    MemoryMap->UsablePageCount -= MetadataPages;
+
+    ZeroMemory(PhysicalToVirtual(Metadata), MetadataPages * PageSize);
+
+    for (usize Order = 0; Order < FrameOrderCount; Order++)
+    {
+        usize BitCount = Allocator->PageCount >> Order;
+
+        Allocator->Bitmaps[Order]   = Metadata;
+        Allocator->FreeLists[Order] = 0;
+
+        Metadata += Align(BitCount, 64) / 8;
+    }
+
+    // NOTE(vak): Release every usable region into the allocator.
+
+    for (usize Index = 0; Index < MemoryMap->RegionCount; Index++)
+    {
+        memory_region* Region = MemoryMap->Regions + Index;
+
+        if (Region->Kind != MemoryRegionKind_Usable)
+            continue;
+
+        ReleaseFrameRange(Region->BaseAddress, Region->BaseAddress + Region->PageCount * PageSize);
+    }
+
+    Allocator->ManagedPageCount    = Allocator->FreePageCount;
+    Allocator->MetadataPageCount   = MetadataPages;
+    Allocator->LowestFreePageCount = Allocator->FreePageCount;
+
+    SerialInfof(
+        Str("Frame allocator: %usize free pages of %usize usable, %usize pages of metadata."),
+        Allocator->FreePageCount,
+        MemoryMap->UsablePageCount,
+        MetadataPages
+    );
+}
+
+local void ReclaimBootMemory(arch_page_map* PageMap, memory_map* MemoryMap)
+{
+    usize PageSize  = ArchGetPageSize();
+    usize Stack     = (usize)&PageSize;
+    usize Reclaimed = 0;
+
+    usize StackLow  = (Stack > BootStackSize) ? ((Stack - BootStackSize) & ~(PageSize - 1)) : 0;
+    usize StackHigh = Align(Stack + BootStackSize, PageSize);
+
+    for (usize Index = 0; Index < MemoryMap->RegionCount; Index++)
+    {
+        memory_region* Region = MemoryMap->Regions + Index;
+
+        if (Region->Kind != MemoryRegionKind_Reclaimable)
+            continue;
+
+        usize Start = Region->BaseAddress;
+        usize End   = Region->BaseAddress + Region->PageCount * PageSize;
+
+        // NOTE(vak): A region that overlaps the stack is split in three,
+        // released around the stack, which needs two more entries in the
+        // memory map.
+
+        usize KeepStart = Maximum(Start, StackLow);
+        usize KeepEnd   = Minimum(End, StackHigh);
+
+        if (KeepStart >= KeepEnd)
+        {
+            KeepStart = End;
+            KeepEnd   = End;
+        }
+        else if (MemoryMap->RegionCount + 2 > MemoryMap->RegionCapacity)
+        {
+            SerialWarnf(Str("No room in the memory map to split the stack region at 0x%p."), Start);
+            continue;
+        }
+
+        usize Ranges[2][2] =
+        {
+            { Start,   KeepStart },
+            { KeepEnd, End       },
+        };
+
+        for (usize Range = 0; Range < 2; Range++)
+        {
+            usize RangeStart = Ranges[Range][0];
+            usize RangeEnd   = Ranges[Range][1];
+
+            if (RangeStart < RangeEnd)
+            {
+                ArchUnmapRange(PageMap, RangeStart, RangeEnd - RangeStart, false);
+                ReleaseFrameRange(RangeStart, RangeEnd);
+
+                // NOTE(vak): Page 0 is never released.
+
+                FrameAllocator.ManagedPageCount += (RangeEnd - Maximum(RangeStart, PageSize)) / PageSize;
+                Reclaimed += (RangeEnd - RangeStart) / PageSize;
+            }
+        }
+
+        Region->Kind      = MemoryRegionKind_Usable;
+        Region->PageCount = (KeepStart - Start) / PageSize;
+
+        if (KeepStart < End)
+        {
+            // NOTE(vak): Insert the kept part and the tail right after
+            // the region, so the map stays sorted, and skip over them.
+
+            memory_region* Regions = MemoryMap->Regions;
+
+            for (usize Slot = MemoryMap->RegionCount; Slot > Index + 1; Slot--)
+                Regions[Slot + 1] = Regions[Slot - 1];
+
+            MemoryMap->RegionCount += 2;
+
+            memory_region* Kept = Regions + Index + 1;
+            memory_region* Tail = Regions + Index + 2;
+
+            Kept->Kind        = MemoryRegionKind_Reclaimable;
+            Kept->BaseAddress = KeepStart;
+            Kept->PageCount   = (KeepEnd - KeepStart) / PageSize;
+
+            Tail->Kind        = MemoryRegionKind_Usable;
+            Tail->BaseAddress = KeepEnd;
+            Tail->PageCount   = (End - KeepEnd) / PageSize;
+
+            Index += 2;
+        }
+    }
+
+    // NOTE(vak): Merges the reclaimed regions with their usable
+    // neighbours, drops the empty ones, and recounts the usable pages.
+
+    NormalizeMemoryMap(MemoryMap);
+
+    SerialInfof(
+        Str("Reclaimed %usize pages of boot services memory, %usize pages usable."),
+        Reclaimed,
+        MemoryMap->UsablePageCount
+    );
+}
+
+local usize GetFrameOrder(usize Size)
+{
+    usize Order = 0;
+
+    while ((ArchGetPageSize() << Order) < Size)
+        Order++;
+
+    return (Order);
+}
+
+local usize ReservePages(usize Order)
+{
+    usize Result = 0;
+
+    if (Order == 0)
+    {
+        Result = ReservePage();
+    }
+    else
+    {
+        b32 Enabled = FrameLock();
+        Result = FrameReserve(Order);
+        FrameUnlock(Enabled);
+
+        if (!Result)
+        {
+            SerialErrorf(Str("Unable to reserve %usize page(s)."), (usize)(1) << Order);
+        }
+    }
+
+    return (Result);
+}
+
+local usize ReservePagesBelow(usize Order, usize Limit)
+{
+    usize Result = 0;
+
+    b32 Enabled = FrameLock();
+    Result = FrameReserveBelow(Order, Limit);
+    FrameUnlock(Enabled);
+
+    if (!Result)
+    {
+        SerialErrorf(Str("Unable to reserve %usize page(s) below 0x%p."), (usize)(1) << Order, Limit);
+    }
+
+    return (Result);
+}
+
+local void ReleasePages(usize Address, usize Order)
 {
-    void* Result = 0;
-    b32 Found = false;
+    if (Order == 0)
+    {
+        ReleasePage(Address);
+    }
+    else
+    {
+        b32 Enabled = FrameLock();
+        FrameRelease(Address, Order);
+        FrameUnlock(Enabled);
+    }
+}
 
-    for (usize Index = 0; Index < MemoryMap->RegionCount; Index++)
+// NOTE(vak): Moves a batch of pages from the allocator to the cold end
+// of a cache, or from the cold end back to the allocator.
+
+local void FrameRefillCache(frame_cache* Cache)
+{
+    AcquireLock(&FrameAllocator.Lock);
+
+    for (usize Index = 0; Index < FrameCacheBatch; Index++)
     {
-        memory_region* Region = MemoryMap->Regions + Index;
+        // NOTE(vak): Counted as cached before it's taken, so the page
+        // never looks reserved to the watermark.
+
+        __atomic_fetch_add(&FrameAllocator.CachedPageCount, 1, __ATOMIC_RELAXED);
+
+        usize Address = FrameReserve(0);
+        if (!Address)
+        {
+            __atomic_fetch_sub(&FrameAllocator.CachedPageCount, 1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        Cache->Bottom = (Cache->Bottom - 1) & (FrameCacheSize - 1);
+        Cache->Pages[Cache->Bottom] = Address;
+        Cache->Count++;
+    }
+
+    ReleaseLock(&FrameAllocator.Lock);
+}
+
+local void FrameDrainCache(frame_cache* Cache)
+{
+    AcquireLock(&FrameAllocator.Lock);
+
+    for (usize Index = 0; (Index < FrameCacheBatch) && Cache->Count; Index++)
+    {
+        FrameRelease(Cache->Pages[Cache->Bottom], 0);
+
+        Cache->Bottom = (Cache->Bottom + 1) & (FrameCacheSize - 1);
+        Cache->Count--;
+
+        __atomic_fetch_sub(&FrameAllocator.CachedPageCount, 1, __ATOMIC_RELAXED);
+    }
+
+    ReleaseLock(&FrameAllocator.Lock);
+}
+
+local usize ReservePage(void)
+{
+    usize Result = 0;
+
+    b32          Enabled = ArchDisableInterrupts();
+    frame_cache* Cache   = FrameCaches + ArchGetCPUIndex();
+
+    if (!Cache->Count)
+        FrameRefillCache(Cache);
+
+    if (Cache->Count)
+    {
+        Cache->Count--;
+        Result = Cache->Pages[(Cache->Bottom + Cache->Count) & (FrameCacheSize - 1)];
+
+        __atomic_fetch_sub(&FrameAllocator.CachedPageCount, 1, __ATOMIC_RELAXED);
+        FrameUpdateWatermark();
+    }
+
+    ArchRestoreInterrupts(Enabled);
+
+    if (!Result)
+    {
+        SerialErrorf(Str("Unable to reserve a page."));
+    }
+
+    return (Result);
+}
+
+local void ReleasePage(usize Address)
+{
+    if (!FrameIsValidBlock(Address, 0))
+        return;
+
+    b32          Enabled = ArchDisableInterrupts();
+    frame_cache* Cache   = FrameCaches + ArchGetCPUIndex();
+
+    if (Cache->Count == FrameCacheSize)
+        FrameDrainCache(Cache);
+
+    Cache->Pages[(Cache->Bottom + Cache->Count) & (FrameCacheSize - 1)] = Address;
+    Cache->Count++;
+
+    __atomic_fetch_add(&FrameAllocator.CachedPageCount, 1, __ATOMIC_RELAXED);
+
+    ArchRestoreInterrupts(Enabled);
+}
+
+local huge_page_pool* FrameGetHugePagePool(usize PageSize)
+{
+    huge_page_pool* Result = 0;
+
+    for (usize Index = 0; Index < HugePagePoolCount; Index++)
+    {
+        if (HugePagePools[Index].PageSize == PageSize)
+        {
+            Result = HugePagePools + Index;
+            break;
+        }
+    }
+
+    return (Result);
+}
+
+local b32 FrameIsHugePageSize(usize PageSize)
+{
+    b32 Result = (
+        (PageSize > ArchGetPageSize()) &&
+        !(PageSize & (PageSize - 1)) &&
+        (GetFrameOrder(PageSize) < FrameOrderCount) &&
+        ArchIsPageSizeSupported(PageSize)
+    );
+
+    if (!Result)
+    {
+        SerialErrorf(Str("Unsupported huge page size %usize."), PageSize);
+    }
+
+    return (Result);
+}
+
+local void SetupHugePagePools(void)
+{
+    usize Sizes  [HugePagePoolCount] = {MB(2), GB(1)};
+    usize Targets[HugePagePoolCount] = {HugePagePool2MB, HugePagePool1GB};
+
+    for (usize Index = 0; Index < HugePagePoolCount; Index++)
+    {
+        huge_page_pool* Pool = HugePagePools + Index;
+
+        Pool->PageSize = Sizes[Index];
+        Pool->Head     = 0;
+        Pool->Count    = 0;
+        Pool->Target   = 0;
 
-        if (Region->Kind != Kind)
+        if (!Targets[Index] || !ArchIsPageSizeSupported(Pool->PageSize))
             continue;
 
-        if (Region->PageCount)
+        usize Order = GetFrameOrder(Pool->PageSize);
+
+        b32 Enabled = FrameLock();
+
+        while (Pool->Count < Targets[Index])
+        {
+            usize Address = FrameReserve(Order);
+            if (!Address)
+                break;
+
+            *(usize*)PhysicalToVirtual(Address) = Pool->Head;
+            Pool->Head = Address;
+            Pool->Count++;
+        }
+
+        FrameUnlock(Enabled);
+
+        Pool->Target = Pool->Count;
+
+        CountPages(MemoryUsage_Pools, Pool->Count << Order);
+
+        if (Pool->Count < Targets[Index])
+        {
+            SerialErrorf(
+                Str("Only set aside %usize of %usize huge pages of %usize bytes."),
+                Pool->Count,
+                (usize)(Targets[Index]),
+                Pool->PageSize
+            );
+        }
+        else
+        {
+            SerialInfof(Str("Set aside %usize huge pages of %usize bytes."), Pool->Count, Pool->PageSize);
+        }
+    }
+}
+
+local usize ReserveHugePage(usize PageSize)
+{
+    usize Result = 0;
+
+    if (FrameIsHugePageSize(PageSize))
+    {
+        huge_page_pool* Pool  = FrameGetHugePagePool(PageSize);
+        usize           Order = GetFrameOrder(PageSize);
+
+        if (Pool)
         {
-            Result = (void*)Region->BaseAddress;
+            b32 Enabled = ArchDisableInterrupts();
+            AcquireLock(&Pool->Lock);
+
+            if (Pool->Head)
+            {
+                Result = Pool->Head;
+                Pool->Head = *(usize*)PhysicalToVirtual(Result);
+                Pool->Count--;
+            }
+
+            ReleaseLock(&Pool->Lock);
+            ArchRestoreInterrupts(Enabled);
+
+            if (Result)
+                CountPages(MemoryUsage_Pools, -((ssize)(1) << Order));
+        }
+
+        if (!Result)
+        {
+            Result = ReservePages(Order);
+        }
+
+        if (Result)
+            CountPages(MemoryUsage_HugePages, (ssize)(1) << Order);
+    }
+
+    return (Result);
+}
+
+local void ReleaseHugePage(usize Address, usize PageSize)
+{
+    if (!FrameIsHugePageSize(PageSize) || (Address & (PageSize - 1)))
+    {
+        SerialErrorf(Str("Invalid huge page release at 0x%p."), Address);
+        return;
+    }
+
+    huge_page_pool* Pool   = FrameGetHugePagePool(PageSize);
+    usize           Order  = GetFrameOrder(PageSize);
+    b32             Pooled = false;
+
+    CountPages(MemoryUsage_HugePages, -((ssize)(1) << Order));
+
+    if (Pool)
+    {
+        b32 Enabled = ArchDisableInterrupts();
+        AcquireLock(&Pool->Lock);
+
+        if (Pool->Count < Pool->Target)
+        {
+            *(usize*)PhysicalToVirtual(Address) = Pool->Head;
+            Pool->Head = Address;
+            Pool->Count++;
+
+            Pooled = true;
+        }
+
+        ReleaseLock(&Pool->Lock);
+        ArchRestoreInterrupts(Enabled);
+    }
+
+    if (Pooled)
+    {
+        CountPages(MemoryUsage_Pools, (ssize)(1) << Order);
+    }
+    else
+    {
+        ReleasePages(Address, Order);
+    }
+}
 
-            Region->BaseAddress += ArchGetPageSize();
-            Region->PageCount--;
+local usize ReserveZeroedPage(void)
+{
+    zero_page_pool* Pool = &ZeroPagePool;
+
+    usize Result = 0;
+
+    b32 Enabled = ArchDisableInterrupts();
+    AcquireLock(&Pool->Lock);
+
+    if (Pool->Head)
+    {
+        Result = Pool->Head;
+        Pool->Head = *(usize*)PhysicalToVirtual(Result);
+        Pool->Count--;
+    }
+
+    ReleaseLock(&Pool->Lock);
+    ArchRestoreInterrupts(Enabled);
+
+    if (Result)
+    {
+        *(usize*)PhysicalToVirtual(Result) = 0;
+        CountPages(MemoryUsage_Pools, -1);
+    }
+    else
+    {
+        // NOTE(vak): The page is about to be used, so zero it with plain
+        // stores that leave it in the cache.
+
+        Result = ReservePage();
+
+        if (Result)
+            ZeroMemory(PhysicalToVirtual(Result), ArchGetPageSize());
+    }
+
+    return (Result);
+}
+
+local b32 FillZeroedPagePool(void)
+{
+    zero_page_pool* Pool = &ZeroPagePool;
+
+    b32 Result = (Pool->Count < ZeroPoolTarget);
 
-            Found = true;
+    for (usize Index = 0; Result && (Index < ZeroPoolBatch); Index++)
+    {
+        usize Page = ReservePage();
+
+        if (!Page)
+        {
+            Result = false;
             break;
         }
+
+        ArchZeroPage(PhysicalToVirtual(Page));
+
+        b32 Enabled = ArchDisableInterrupts();
+        AcquireLock(&Pool->Lock);
+
+        *(usize*)PhysicalToVirtual(Page) = Pool->Head;
+        Pool->Head = Page;
+        Pool->Count++;
+
+        Result = (Pool->Count < ZeroPoolTarget);
+
+        ReleaseLock(&Pool->Lock);
+        ArchRestoreInterrupts(Enabled);
+
+        CountPages(MemoryUsage_Pools, 1);
     }
 
-    if (!Found)
+    return (Result);
+}
+
+local void CountPages(memory_usage Usage, ssize PageCount)
+{
+    __atomic_fetch_add(MemoryUsageCounts + Usage, (usize)PageCount, __ATOMIC_RELAXED);
+}
+
+local void GetMemoryStats(memory_stats* Stats)
+{
+    frame_allocator* Allocator = &FrameAllocator;
+
+    ZeroType(Stats);
+
+    b32 Enabled = FrameLock();
+
+    Stats->ManagedPages    = Allocator->ManagedPageCount;
+    Stats->FreePages       = Allocator->FreePageCount + __atomic_load_n(&Allocator->CachedPageCount, __ATOMIC_RELAXED);
+    Stats->LowestFreePages = Allocator->LowestFreePageCount;
+    Stats->MetadataPages   = Allocator->MetadataPageCount;
+
+    for (usize Order = 0; Order < FrameOrderCount; Order++)
+        Stats->FreeBlocks[Order] = Allocator->FreeCounts[Order];
+
+    FrameUnlock(Enabled);
+
+    // NOTE(vak): The counters aren't read atomically with the allocator,
+    // which is fine for statistics.
+
+    usize Counted = Stats->FreePages;
+
+    for (usize Usage = MemoryUsage_Other + 1; Usage < MemoryUsage_COUNT; Usage++)
     {
-        SerialErrorf(Str("Unable to reserve a page."));
+        Stats->UsedPages[Usage] = __atomic_load_n(MemoryUsageCounts + Usage, __ATOMIC_RELAXED);
+        Counted += Stats->UsedPages[Usage];
     }
 
+    if (Stats->ManagedPages > Counted)
+        Stats->UsedPages[MemoryUsage_Other] = Stats->ManagedPages - Counted;
+}
+
+local usize GetFragmentationIndex(memory_stats* Stats, usize Order)
+{
+    usize Result = 0;
+
+    // NOTE(vak): Free pages in the per-CPU caches are single pages, so
+    // they only count towards order 0.
+
+    usize Usable = 0;
+
+    for (usize Current = Order; Current < FrameOrderCount; Current++)
+        Usable += Stats->FreeBlocks[Current] << Current;
+
+    if (Order == 0)
+        Usable = Stats->FreePages;
+
+    if (Stats->FreePages && (Usable < Stats->FreePages))
+        Result = ((Stats->FreePages - Usable) * 1000) / Stats->FreePages;
+
     return (Result);
 }
+
+local void DumpMemoryStats(void)
+{
+    string UsageNames[MemoryUsage_COUNT] =
+    {
+        [MemoryUsage_Other]      = Str("other"),
+        [MemoryUsage_PageTables] = Str("page tables"),
+        [MemoryUsage_Slabs]      = Str("slabs"),
+        [MemoryUsage_Heap]       = Str("heap"),
+        [MemoryUsage_DMA]        = Str("DMA"),
+        [MemoryUsage_HugePages]  = Str("huge pages"),
+        [MemoryUsage_Anonymous]  = Str("anonymous"),
+        [MemoryUsage_Pools]      = Str("pools"),
+        [MemoryUsage_Stacks]     = Str("stacks"),
+    };
+
+    memory_stats Stats = {0};
+    GetMemoryStats(&Stats);
+
+    usize PageSize = ArchGetPageSize();
+
+    SerialInfof(
+        Str("Memory: %usize of %usize pages free, lowest %usize, %usize pages of metadata."),
+        Stats.FreePages,
+        Stats.ManagedPages,
+        Stats.LowestFreePages,
+        Stats.MetadataPages
+    );
+
+    for (usize Usage = 0; Usage < MemoryUsage_COUNT; Usage++)
+    {
+        SerialInfof(Str("    %12str %-8usize pages"), UsageNames[Usage], Stats.UsedPages[Usage]);
+    }
+
+    for (usize Order = 0; Order < FrameOrderCount; Order++)
+    {
+        SerialInfof(
+            Str("    order %-2usize (%-8usize KB): %-8usize free blocks, fragmentation %-4usize/1000"),
+            Order,
+            (PageSize << Order) >> 10,
+            Stats.FreeBlocks[Order],
+            GetFragmentationIndex(&Stats, Order)
+        );
+    }
+}
+
+local void MapPhysicalMemory(arch_page_map* PageMap, memory_map* MemoryMap)
+{
+    usize PageSize = ArchGetPageSize();
+    usize Base     = ArchGetDirectMapBase();
+    usize Limit    = ArchGetDirectMapSize();
+
+    // NOTE(vak): Physically contiguous regions are mapped as one run,
+    // as long as they share a cache type, so that large pages can span
+    // them.
+
+    usize RunStart  = 0;
+    usize RunEnd    = 0;
+    b32   RunDevice = false;
+    usize Mapped    = 0;
+
+    for (usize Index = 0; Index <= MemoryMap->RegionCount; Index++)
+    {
+        usize Start  = 0;
+        usize End    = 0;
+        b32   Device = false;
+
+        if (Index < MemoryMap->RegionCount)
+        {
+            memory_region* Region = MemoryMap->Regions + Index;
+
+            Start  = Region->BaseAddress & ~(PageSize - 1);
+            End    = Region->BaseAddress + Region->PageCount * PageSize;
+            Device = (Region->Kind == MemoryRegionKind_Device);
+
+            if (Start == End)
+                continue;
+
+            if ((RunStart != RunEnd) && (Start == RunEnd) && (Device == RunDevice))
+            {
+                RunEnd = End;
+                continue;
+            }
+        }
+
+        if (RunStart != RunEnd)
+        {
+            if (RunEnd > Limit)
+            {
+                SerialWarnf(Str("Physical memory at 0x%p is beyond the direct map."), Maximum(RunStart, Limit));
+                RunEnd = Limit;
+            }
+
+            if (RunStart < RunEnd)
+            {
+                arch_map_flags Flags = ArchMapFlag_Write | ArchMapFlag_Global;
+
+                if (RunDevice)
+                    Flags |= ArchMapFlag_Uncached;
+
+                ArchMapRange(PageMap, RunStart, Base + RunStart, RunEnd - RunStart, Flags);
+                Mapped += RunEnd - RunStart;
+            }
+        }
+
+        RunStart  = Start;
+        RunEnd    = End;
+        RunDevice = Device;
+    }
+
+    SerialInfof(Str("Direct mapped %usize MB of physical memory at 0x%p."), Mapped >> 20, Base);
+}
+
+local void MapBootMemory(arch_page_map* PageMap, memory_map* MemoryMap)
+{
+    // NOTE(vak): The kernel image, its stack and the data handed over
+    // by the bootloader are still addressed physically, so keep those
+    // regions identity mapped.
+
+    for (usize Index = 0; Index < MemoryMap->RegionCount; Index++)
+    {
+        memory_region* Region = MemoryMap->Regions + Index;
+
+        b32 Boot = (
+            (Region->Kind == MemoryRegionKind_BootCode) ||
+            (Region->Kind == MemoryRegionKind_BootData) ||
+            (Region->Kind == MemoryRegionKind_Reclaimable)
+        );
+
+        if (Boot)
+        {
+            usize Address = Region->BaseAddress;
+            usize Size    = Region->PageCount * ArchGetPageSize();
+
+            ArchMapRange(PageMap, Address, Address, Size, ArchMapFlag_Write | ArchMapFlag_Global);
+        }
+    }
+}
+
+local void MapKernelImage(arch_page_map* PageMap, image_map* ImageMap)
+{
+    usize PageSize = ArchGetPageSize();
+
+    // NOTE(vak): The image stays where the firmware loaded it. Headers
+    // and anything between sections are mapped read-only, then every
+    // section is mapped with its own access rights. Sections that
+    // don't start on a page boundary share pages with their neighbors,
+    // in which case the whole image is left writable and executable.
+
+    b32 Aligned = true;
+
+    for (usize Index = 0; Index < ImageMap->SectionCount; Index++)
+    {
+        if (ImageMap->Sections[Index].BaseAddress & (PageSize - 1))
+            Aligned = false;
+    }
+
+    usize ImageSize = Align(ImageMap->Size, PageSize);
+
+    if (!Aligned)
+    {
+        SerialWarnf(Str("Kernel image sections are not page aligned."));
+
+        arch_map_flags Flags = ArchMapFlag_Write | ArchMapFlag_Execute | ArchMapFlag_Global;
+        ArchMapRange(PageMap, ImageMap->BaseAddress, ImageMap->BaseAddress, ImageSize, Flags);
+    }
+    else
+    {
+        ArchMapRange(PageMap, ImageMap->BaseAddress, ImageMap->BaseAddress, ImageSize, ArchMapFlag_Global);
+
+        for (usize Index = 0; Index < ImageMap->SectionCount; Index++)
+        {
+            image_section* Section = ImageMap->Sections + Index;
+
+            arch_map_flags Flags = ArchMapFlag_Global;
+
+            if (Section->Flags & ImageSectionFlag_Write  ) Flags |= ArchMapFlag_Write;
+            if (Section->Flags & ImageSectionFlag_Execute) Flags |= ArchMapFlag_Execute;
+
+            usize Size = Align(Section->Size, PageSize);
+            ArchMapRange(PageMap, Section->BaseAddress, Section->BaseAddress, Size, Flags);
+        }
+    }
+
+    SerialInfof(Str("Mapped kernel image at 0x%p (%usize sections)."), ImageMap->BaseAddress, ImageMap->SectionCount);
+}
+
+local void UseDirectMap(void)
+{
+    DirectMapOffset = ArchGetDirectMapBase();
+}
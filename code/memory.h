@@ -1,3 +1,6 @@
+#pragma once
+
+typedef struct arch_page_map arch_page_map;
 
 typedef usize memory_region_kind;
 enum
@@ -6,7 +9,11 @@ enum
 
     MemoryRegionKind_BootCode,
     MemoryRegionKind_BootData,
+    MemoryRegionKind_Reclaimable, // NOTE(vak): Boot services memory, usable once the kernel is done with it
     MemoryRegionKind_Usable,
+    MemoryRegionKind_Device,
+    MemoryRegionKind_PageTables, // NOTE(vak): The kernel page map built by the bootloader
+    MemoryRegionKind_Runtime,    // NOTE(vak): Firmware runtime services
 
     MemoryRegionKind_COUNT,
 };
@@ -21,7 +28,257 @@ typedef struct
 typedef struct
 {
     usize          RegionCount;
+    usize          RegionCapacity;
     memory_region* Regions;
+
+    usize          UsablePageCount;
 } memory_map;
 
-local void* ReservePage(memory_map* MemoryMap, memory_region_kind Kind);
+// NOTE(vak): Sorts the regions by address and merges adjacent regions
+// of the same kind, which also recounts the usable pages.
+
+local void NormalizeMemoryMap(memory_map* MemoryMap);
+
+typedef usize image_section_flags;
+enum
+{
+    ImageSectionFlag_Write   = (1 << 0),
+    ImageSectionFlag_Execute = (1 << 1),
+};
+
+typedef struct
+{
+    usize               BaseAddress;
+    usize               Size;
+    image_section_flags Flags;
+} image_section;
+
+#define ImageMaxSectionCount (32)
+
+typedef struct
+{
+    usize         BaseAddress;
+    usize         Size;
+
+    usize         SectionCount;
+    image_section Sections[ImageMaxSectionCount];
+} image_map;
+
+// NOTE(vak): Physical frame allocator
+//
+// A binary buddy allocator over all usable physical memory. A block
+// of order N is 2^N contiguous pages, aligned to its own size. Each
+// order keeps a doubly linked free list threaded through the free
+// blocks themselves, along with a bitmap that marks which blocks are
+// free, so a block's buddy can be checked and unlinked in O(1).
+// Reserving and releasing a block is therefore O(MaxOrder).
+
+#define FrameOrderCount (19) // NOTE(vak): Up to 2^18 pages (1GB)
+
+typedef struct
+{
+    usize Next;
+    usize Prev;
+} frame_node;
+
+typedef struct
+{
+    spin_lock Lock;
+
+    usize BaseAddress;
+    usize PageCount;
+    usize FreePageCount;   // NOTE(vak): Not counting the pages in the caches
+    usize CachedPageCount; // NOTE(vak): Pages in all caches, updated atomically
+
+    usize ManagedPageCount;    // NOTE(vak): Pages released into the allocator at boot
+    usize MetadataPageCount;
+    usize LowestFreePageCount; // NOTE(vak): Including the pages in the caches
+
+    usize FreeLists[FrameOrderCount];
+    usize FreeCounts[FrameOrderCount];
+    usize Bitmaps[FrameOrderCount];
+} frame_allocator;
+
+// NOTE(vak): Per-CPU page caches
+//
+// Single pages are reserved from and released to a cache that belongs
+// to the current processor, so that most calls to ReservePage and
+// ReleasePage neither take the allocator lock nor touch shared cache
+// lines. A cache is a ring of pages with a hot and a cold end: released
+// pages go on the hot end and are the first to be handed out again,
+// while they are likely still in the processor's caches. An empty cache
+// is refilled with a batch of pages at the cold end, and a full cache
+// drains a batch from the cold end back to the allocator.
+
+#define FrameCacheSize  (64) // NOTE(vak): Must be a power of 2
+#define FrameCacheBatch (16)
+
+typedef struct
+{
+    _Alignas(64) usize Pages[FrameCacheSize];
+
+    usize Bottom; // NOTE(vak): Index of the cold end
+    usize Count;
+} frame_cache;
+
+local void SetupFrameAllocator(memory_map* MemoryMap);
+
+// NOTE(vak): Hands boot services memory over to the frame allocator and
+// removes its identity mapping. The stack the kernel runs on is boot
+// services memory too, so BootStackSize bytes on either side of it are
+// kept, UEFI guarantees at least that much stack.
+
+#define BootStackSize (KB(128))
+
+local void ReclaimBootMemory(arch_page_map* PageMap, memory_map* MemoryMap);
+
+// NOTE(vak): Returns the smallest order of block that holds Size bytes.
+
+local usize GetFrameOrder(usize Size);
+
+local usize ReservePages(usize Order);
+local void  ReleasePages(usize Address, usize Order);
+
+// NOTE(vak): Reserves a block that lies entirely below the given
+// physical address, for devices that can't address all of memory.
+// Slower than ReservePages, since it has to search the free lists.
+
+local usize ReservePagesBelow(usize Order, usize Limit);
+
+// NOTE(vak): Releases any page aligned range, which doesn't have to be
+// a single block.
+
+local void ReleaseFrameRange(usize Address, usize End);
+
+local usize ReservePage(void);
+local void  ReleasePage(usize Address);
+
+// NOTE(vak): Huge pages
+//
+// Frames for large mappings have to be physically contiguous and
+// aligned to their own size, which is exactly what a buddy block of the
+// matching order is. ReserveHugePage takes such a block, from a pool if
+// one was set aside for that size. The pools are filled once at boot,
+// before physical memory has a chance to fragment, and only hand their
+// frames out again through ReserveHugePage. Released huge pages refill
+// their pool up to its initial size. Define HugePagePool2MB or
+// HugePagePool1GB to change how many frames are set aside.
+
+#if !defined(HugePagePool2MB)
+#  define HugePagePool2MB (8)
+#endif
+
+#if !defined(HugePagePool1GB)
+#  define HugePagePool1GB (0)
+#endif
+
+#define HugePagePoolCount (2)
+
+typedef struct
+{
+    spin_lock Lock;
+    usize     PageSize;
+    usize     Head;     // NOTE(vak): Physical address
+    usize     Count;
+    usize     Target;   // NOTE(vak): Frames set aside at boot
+} huge_page_pool;
+
+local void SetupHugePagePools(void);
+
+// NOTE(vak): PageSize has to be a large page size the architecture
+// supports. Returns the physical address, or 0.
+
+local usize ReserveHugePage(usize PageSize);
+local void  ReleaseHugePage(usize Address, usize PageSize);
+
+// NOTE(vak): Pre-zeroed pages
+//
+// Pages that are known to be zero are kept in a pool, which is topped
+// up whenever a processor is idle, using stores that bypass the caches.
+// Page tables and demand-zero pages are taken from the pool, so that
+// zeroing stays off the critical path. The pool is linked through the
+// first word of each page, which is cleared again when the page is
+// handed out. If the pool is empty, a page is zeroed on the spot.
+
+#define ZeroPoolTarget (256) // NOTE(vak): Pages
+#define ZeroPoolBatch  (16)
+
+typedef struct
+{
+    spin_lock Lock;
+    usize     Head;  // NOTE(vak): Physical address
+    usize     Count;
+} zero_page_pool;
+
+local usize ReserveZeroedPage(void);
+
+// NOTE(vak): Zeroes a batch of pages into the pool, returns false once
+// the pool is full.
+
+local b32 FillZeroedPagePool(void);
+
+// NOTE(vak): Memory statistics
+//
+// Subsystems count the pages they take from and give back to the frame
+// allocator, which is cheap enough to always be on. Together with the
+// free pages, the counters should add up to all managed pages, whatever
+// is missing is reported as other, which is where leaks show up. The
+// lowest number of free pages seen so far is kept as a watermark.
+//
+// The fragmentation index of an order is how much of the free memory
+// can't be used for a block of that order, in thousandths. It's 0 when
+// every free page is part of a large enough block, and approaches 1000
+// when free memory is only left in smaller pieces.
+
+typedef usize memory_usage;
+enum
+{
+    MemoryUsage_Other = 0, // NOTE(vak): Not counted by any of the others
+    MemoryUsage_PageTables,
+    MemoryUsage_Slabs,
+    MemoryUsage_Heap,
+    MemoryUsage_DMA,
+    MemoryUsage_HugePages,
+    MemoryUsage_Anonymous, // NOTE(vak): Demand-zero pages of virtual regions
+    MemoryUsage_Pools,     // NOTE(vak): Pre-zeroed and huge page pools
+    MemoryUsage_Stacks,
+
+    MemoryUsage_COUNT,
+};
+
+typedef struct
+{
+    usize ManagedPages;
+    usize FreePages;       // NOTE(vak): Including the per-CPU caches
+    usize LowestFreePages;
+    usize MetadataPages;
+
+    usize UsedPages[MemoryUsage_COUNT];
+    usize FreeBlocks[FrameOrderCount];
+} memory_stats;
+
+local void  CountPages(memory_usage Usage, ssize PageCount);
+
+local void  GetMemoryStats(memory_stats* Stats);
+local usize GetFragmentationIndex(memory_stats* Stats, usize Order);
+local void  DumpMemoryStats(void);
+
+// NOTE(vak): Direct map
+//
+// All physical memory described by the memory map is mapped into the
+// higher half at ArchGetDirectMapBase(), using the largest pages that
+// fit. Device regions are mapped uncached. Once the kernel page map is
+// active, converting between physical and virtual addresses is a
+// constant offset. Before that, physical memory is reached through the
+// identity map set up by the firmware.
+//
+// Anything that has to stay valid across that switch is stored as a
+// physical address and converted when it is accessed.
+
+local void  MapPhysicalMemory(arch_page_map* PageMap, memory_map* MemoryMap);
+local void  MapBootMemory(arch_page_map* PageMap, memory_map* MemoryMap);
+local void  MapKernelImage(arch_page_map* PageMap, image_map* ImageMap);
+local void  UseDirectMap(void);
+
+local void* PhysicalToVirtual(usize PhysicalAddress);
+local usize VirtualToPhysical(void* VirtualAddress);
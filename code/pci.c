@@ -0,0 +1,405 @@
+local pci_segment PCISegments[PCIMaxSegmentCount] = {0};
+local usize       PCISegmentCount                 = 0;
+
+local void PCIAddSegment(u16 Segment, u8 StartBus, u8 EndBus, usize BaseAddress)
+{
+    if (PCISegmentCount >= PCIMaxSegmentCount)
+    {
+        SerialErrorf(Str("Too many PCIe segments, ignoring segment %u16."), Segment);
+    }
+    else
+    {
+        pci_segment* Result = PCISegments + PCISegmentCount++;
+
+        Result->BaseAddress = BaseAddress;
+        Result->Segment     = Segment;
+        Result->StartBus    = StartBus;
+        Result->EndBus      = EndBus;
+    }
+}
+
+local b32 PCIGetFunction(pci_function* Result, u16 Segment, u8 Bus, u8 Device, u8 Function)
+{
+    b32 Found = false;
+
+    if ((Device < 32) && (Function < 8))
+    {
+        for (usize Index = 0; Index < PCISegmentCount; Index++)
+        {
+            pci_segment* Entry = PCISegments + Index;
+
+            if ((Entry->Segment == Segment) && (Bus >= Entry->StartBus) && (Bus <= Entry->EndBus))
+            {
+                usize Offset = ((usize)(Bus) << 20) | ((usize)(Device) << 15) | ((usize)(Function) << 12);
+
+                Result->Segment  = Segment;
+                Result->Bus      = Bus;
+                Result->Device   = Device;
+                Result->Function = Function;
+                Result->Config   = (usize)PhysicalToVirtual(Entry->BaseAddress + Offset);
+
+                // NOTE(vak): Reads of functions that aren't there return
+                // all ones.
+
+                Found = (PCIRead16(Result, PCI_VendorID) != 0xFFFF);
+                break;
+            }
+        }
+    }
+
+    return (Found);
+}
+
+local u8 PCIRead8(pci_function* Function, usize Offset)
+{
+    u8 Result = *(volatile u8*)(Function->Config + Offset);
+    return (Result);
+}
+
+local u16 PCIRead16(pci_function* Function, usize Offset)
+{
+    u16 Result = *(volatile u16*)(Function->Config + Offset);
+    return (Result);
+}
+
+local u32 PCIRead32(pci_function* Function, usize Offset)
+{
+    u32 Result = *(volatile u32*)(Function->Config + Offset);
+    return (Result);
+}
+
+local void PCIWrite8(pci_function* Function, usize Offset, u8 Value)
+{
+    *(volatile u8*)(Function->Config + Offset) = Value;
+}
+
+local void PCIWrite16(pci_function* Function, usize Offset, u16 Value)
+{
+    *(volatile u16*)(Function->Config + Offset) = Value;
+}
+
+local void PCIWrite32(pci_function* Function, usize Offset, u32 Value)
+{
+    *(volatile u32*)(Function->Config + Offset) = Value;
+}
+
+local usize PCIFindCapability(pci_function* Function, u8 ID)
+{
+    usize Result = 0;
+
+    if (PCIRead16(Function, PCI_Status) & PCI_Status_Capabilities)
+    {
+        usize Offset = PCIRead8(Function, PCI_Capabilities) & ~3;
+
+        // NOTE(vak): The list lives in the first 256 bytes, so a broken
+        // one that loops can't have more entries than this.
+
+        for (usize Count = 0; Offset && (Count < 48); Count++)
+        {
+            if (PCIRead8(Function, Offset) == ID)
+            {
+                Result = Offset;
+                break;
+            }
+
+            Offset = PCIRead8(Function, Offset + 1) & ~3;
+        }
+    }
+
+    return (Result);
+}
+
+local usize PCIGetBAR(pci_function* Function, usize Index)
+{
+    usize Result = 0;
+
+    u32 Low = PCIRead32(Function, PCI_BAR0 + 4 * Index);
+
+    if (!(Low & PCI_BAR_IO))
+    {
+        Result = Low & ~(usize)0xF;
+
+        if (((Low & PCI_BAR_TypeMask) == PCI_BAR_Type64) && (Index < 5))
+            Result |= (usize)PCIRead32(Function, PCI_BAR0 + 4 * (Index + 1)) << 32;
+    }
+
+    return (Result);
+}
+
+local usize PCIGetMSIXEntry(pci_msi* MSI, usize Index)
+{
+    usize Result = MSI->Table + Index * PCI_MSIX_EntrySize;
+    return (Result);
+}
+
+local b32 PCISetupMSIX(pci_msi* MSI, pci_function* Function, usize Capability)
+{
+    b32 Result = false;
+
+    usize PageSize = ArchGetPageSize();
+
+    u16 Control = PCIRead16(Function, Capability + PCI_MSIX_Control);
+    u32 Table   = PCIRead32(Function, Capability + PCI_MSIX_Table);
+
+    usize Count    = (usize)(Control & PCI_MSIX_SizeMask) + 1;
+    usize BAR      = PCIGetBAR(Function, Table & PCI_MSIX_BIRMask);
+    usize Physical = BAR + (Table & ~(u32)PCI_MSIX_BIRMask);
+
+    // NOTE(vak): The table is device memory, which may be anywhere in
+    // the physical address space, so it gets its own mapping from the
+    // kernel arena rather than going through the direct map.
+
+    usize Base = Physical & ~(PageSize - 1);
+    usize Size = Align(Physical + Count * PCI_MSIX_EntrySize, PageSize) - Base;
+
+    usize Virtual = 0;
+
+    if (!BAR)
+    {
+        SerialErrorf(Str("PCI %u8:%u8.%u8 has no memory BAR for its MSI-X table."), Function->Bus, Function->Device, Function->Function);
+    }
+    else
+    {
+        Virtual = VMemAllocate(GetKernelArena(), Size, VMemFlag_InstantFit);
+    }
+
+    b32 Mapped = Virtual && ArchMapRange(
+        ArchGetKernelPageMap(),
+        Base,
+        Virtual,
+        Size,
+        ArchMapFlag_Write | ArchMapFlag_Uncached | ArchMapFlag_Global
+    );
+
+    if (Virtual && !Mapped)
+    {
+        ArchUnmapRange(ArchGetKernelPageMap(), Virtual, Size, false);
+        VMemFree(GetKernelArena(), Virtual, Size);
+    }
+
+    if (Mapped)
+    {
+        MSI->Extended  = true;
+        MSI->Count     = Count;
+        MSI->Table     = Virtual + (Physical - Base);
+        MSI->TableBase = Virtual;
+        MSI->TableSize = Size;
+
+        // NOTE(vak): The table is only reachable with memory decoding
+        // on. Hold every interrupt back with the function mask while the
+        // entries are masked one by one.
+
+        u16 Command = PCIRead16(Function, PCI_Command);
+        PCIWrite16(Function, PCI_Command, Command | PCI_Command_Memory | PCI_Command_BusMaster | PCI_Command_DisableINTx);
+
+        PCIWrite16(Function, Capability + PCI_MSIX_Control, Control | PCI_MSIX_FunctionMask | PCI_MSIX_Enable);
+
+        for (usize Index = 0; Index < Count; Index++)
+        {
+            volatile u32* Entry = (volatile u32*)PCIGetMSIXEntry(MSI, Index);
+            Entry[PCI_MSIX_EntryControl / 4] |= PCI_MSIX_EntryMasked;
+        }
+
+        PCIWrite16(Function, Capability + PCI_MSIX_Control, (Control | PCI_MSIX_Enable) & ~PCI_MSIX_FunctionMask);
+
+        Result = true;
+    }
+
+    return (Result);
+}
+
+local b32 PCISetupMSI(pci_msi* MSI, pci_function* Function)
+{
+    b32 Result = false;
+
+    ZeroType(MSI);
+
+    MSI->Function = Function;
+
+    usize MSIX  = PCIFindCapability(Function, PCI_Capability_MSIX);
+    usize Plain = PCIFindCapability(Function, PCI_Capability_MSI);
+
+    if (MSIX)
+    {
+        MSI->Capability = MSIX;
+        Result = PCISetupMSIX(MSI, Function, MSIX);
+    }
+    else if (Plain)
+    {
+        MSI->Capability = Plain;
+        MSI->Count      = 1;
+
+        // NOTE(vak): Left disabled until the message has a vector, with
+        // a single message enabled.
+
+        u16 Control = PCIRead16(Function, Plain + PCI_MSI_Control);
+        PCIWrite16(Function, Plain + PCI_MSI_Control, Control & ~(PCI_MSI_Enable | PCI_MSI_MessageMask));
+
+        u16 Command = PCIRead16(Function, PCI_Command);
+        PCIWrite16(Function, PCI_Command, Command | PCI_Command_BusMaster | PCI_Command_DisableINTx);
+
+        Result = true;
+    }
+    else
+    {
+        SerialErrorf(Str("PCI %u8:%u8.%u8 doesn't support message interrupts."), Function->Bus, Function->Device, Function->Function);
+    }
+
+    if (Result)
+    {
+        SerialInfof(
+            Str("PCI %u8:%u8.%u8: %usize %str interrupts"),
+            Function->Bus,
+            Function->Device,
+            Function->Function,
+            MSI->Count,
+            MSI->Extended ? Str("MSI-X") : Str("MSI")
+        );
+    }
+
+    return (Result);
+}
+
+local void PCIDisableMSI(pci_msi* MSI)
+{
+    pci_function* Function = MSI->Function;
+
+    if (MSI->Extended)
+    {
+        u16 Control = PCIRead16(Function, MSI->Capability + PCI_MSIX_Control);
+        PCIWrite16(Function, MSI->Capability + PCI_MSIX_Control, Control & ~PCI_MSIX_Enable);
+
+        ArchUnmapRange(ArchGetKernelPageMap(), MSI->TableBase, MSI->TableSize, false);
+        VMemFree(GetKernelArena(), MSI->TableBase, MSI->TableSize);
+    }
+    else if (MSI->Capability)
+    {
+        u16 Control = PCIRead16(Function, MSI->Capability + PCI_MSI_Control);
+        PCIWrite16(Function, MSI->Capability + PCI_MSI_Control, Control & ~PCI_MSI_Enable);
+    }
+
+    ZeroType(MSI);
+}
+
+local b32 PCISetMSIVector(pci_msi* MSI, usize Index, u32 TargetID, usize Vector)
+{
+    b32 Result = false;
+
+    u64 Address = 0;
+    u32 Data    = 0;
+
+    if (Index >= MSI->Count)
+    {
+        SerialErrorf(Str("Invalid message interrupt %usize of %usize."), Index, MSI->Count);
+    }
+    else if (ArchGetMessageInterrupt(TargetID, Vector, &Address, &Data))
+    {
+        pci_function* Function   = MSI->Function;
+        usize         Capability = MSI->Capability;
+
+        if (MSI->Extended)
+        {
+            // NOTE(vak): Entries are only safe to change while masked.
+
+            volatile u32* Entry = (volatile u32*)PCIGetMSIXEntry(MSI, Index);
+
+            Entry[PCI_MSIX_EntryControl / 4] |= PCI_MSIX_EntryMasked;
+
+            Entry[PCI_MSIX_EntryAddress / 4 + 0] = (u32)(Address);
+            Entry[PCI_MSIX_EntryAddress / 4 + 1] = (u32)(Address >> 32);
+            Entry[PCI_MSIX_EntryData    / 4]     = Data;
+
+            Entry[PCI_MSIX_EntryControl / 4] &= ~(u32)PCI_MSIX_EntryMasked;
+        }
+        else
+        {
+            u16 Control = PCIRead16(Function, Capability + PCI_MSI_Control);
+            b32 Wide    = (Control & PCI_MSI_64Bit) != 0;
+
+            PCIWrite16(Function, Capability + PCI_MSI_Control, Control & ~PCI_MSI_Enable);
+
+            PCIWrite32(Function, Capability + PCI_MSI_AddressLow, (u32)(Address));
+
+            if (Wide)
+            {
+                PCIWrite32(Function, Capability + PCI_MSI_AddressHigh, (u32)(Address >> 32));
+                PCIWrite16(Function, Capability + PCI_MSI_Data64, (u16)Data);
+            }
+            else
+            {
+                PCIWrite16(Function, Capability + PCI_MSI_Data32, (u16)Data);
+            }
+
+            if (Control & PCI_MSI_PerVectorMask)
+                PCIWrite32(Function, Capability + (Wide ? PCI_MSI_Mask64 : PCI_MSI_Mask32), 0);
+
+            PCIWrite16(Function, Capability + PCI_MSI_Control, (Control & ~PCI_MSI_MessageMask) | PCI_MSI_Enable);
+        }
+
+        Result = true;
+    }
+
+    return (Result);
+}
+
+local void PCIMaskMSIVector(pci_msi* MSI, usize Index)
+{
+    pci_function* Function   = MSI->Function;
+    usize         Capability = MSI->Capability;
+
+    if (Index >= MSI->Count)
+    {
+        SerialErrorf(Str("Invalid message interrupt %usize of %usize."), Index, MSI->Count);
+    }
+    else if (MSI->Extended)
+    {
+        volatile u32* Entry = (volatile u32*)PCIGetMSIXEntry(MSI, Index);
+        Entry[PCI_MSIX_EntryControl / 4] |= PCI_MSIX_EntryMasked;
+    }
+    else
+    {
+        // NOTE(vak): Without per-vector masking, the only way to hold
+        // the message back is to disable MSI.
+
+        u16 Control = PCIRead16(Function, Capability + PCI_MSI_Control);
+
+        if (Control & PCI_MSI_PerVectorMask)
+        {
+            usize Mask = Capability + ((Control & PCI_MSI_64Bit) ? PCI_MSI_Mask64 : PCI_MSI_Mask32);
+            PCIWrite32(Function, Mask, 1);
+        }
+        else
+        {
+            PCIWrite16(Function, Capability + PCI_MSI_Control, Control & ~PCI_MSI_Enable);
+        }
+    }
+}
+
+local usize PCIAllocateMSIVector(
+    pci_msi*                MSI,
+    usize                   Index,
+    u32                     TargetID,
+    arch_interrupt_handler* Handler,
+    void*                   Context
+)
+{
+    usize Result = ArchAllocateInterruptVector(Handler, Context);
+
+    if (!Result)
+    {
+        SerialErrorf(Str("No interrupt vector left for message interrupt %usize."), Index);
+    }
+    else if (!PCISetMSIVector(MSI, Index, TargetID, Result))
+    {
+        ArchClearInterruptHandler(Result);
+        Result = 0;
+    }
+
+    return (Result);
+}
+
+local void PCIReleaseMSIVector(pci_msi* MSI, usize Index, usize Vector)
+{
+    PCIMaskMSIVector(MSI, Index);
+    ArchClearInterruptHandler(Vector);
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+// NOTE(vak): PCI Express configuration space
+//
+// Every function has 4KB of configuration space, found through the MCFG
+// segments at Base + (Bus << 20 | Device << 15 | Function << 12). The
+// segments are mapped into the direct map by KernelEntry.
+
+#define PCIMaxSegmentCount (16)
+
+#define PCI_VendorID       (0x00)
+#define PCI_DeviceID       (0x02)
+#define PCI_Command        (0x04)
+#define PCI_Status         (0x06)
+#define PCI_HeaderType     (0x0E)
+#define PCI_BAR0           (0x10)
+#define PCI_Capabilities   (0x34)
+
+#define PCI_Command_Memory          (1 << 1)
+#define PCI_Command_BusMaster       (1 << 2)
+#define PCI_Command_DisableINTx     (1 << 10)
+
+#define PCI_Status_Capabilities     (1 << 4)
+
+#define PCI_BAR_IO                  (1 << 0)
+#define PCI_BAR_TypeMask            (0x6)
+#define PCI_BAR_Type64              (0x4)
+
+#define PCI_Capability_MSI          (0x05)
+#define PCI_Capability_MSIX         (0x11)
+
+typedef struct
+{
+    usize BaseAddress; // NOTE(vak): Physical address of bus 0
+    u16   Segment;
+    u8    StartBus;
+    u8    EndBus;
+} pci_segment;
+
+typedef struct
+{
+    u16   Segment;
+    u8    Bus;
+    u8    Device;
+    u8    Function;
+    usize Config;      // NOTE(vak): Virtual address of the configuration space
+} pci_function;
+
+local void PCIAddSegment(u16 Segment, u8 StartBus, u8 EndBus, usize BaseAddress);
+
+// NOTE(vak): Fails if no segment covers the bus, or nothing responds at
+// the address.
+
+local b32 PCIGetFunction(pci_function* Result, u16 Segment, u8 Bus, u8 Device, u8 Function);
+
+local u8   PCIRead8(pci_function* Function, usize Offset);
+local u16  PCIRead16(pci_function* Function, usize Offset);
+local u32  PCIRead32(pci_function* Function, usize Offset);
+local void PCIWrite8(pci_function* Function, usize Offset, u8 Value);
+local void PCIWrite16(pci_function* Function, usize Offset, u16 Value);
+local void PCIWrite32(pci_function* Function, usize Offset, u32 Value);
+
+// NOTE(vak): Returns the offset of the capability, or 0 if the function
+// doesn't have it.
+
+local usize PCIFindCapability(pci_function* Function, u8 ID);
+
+// NOTE(vak): Returns the physical address of a memory BAR, or 0 for I/O
+// BARs. 64-bit BARs take up two slots, Index is the first one.
+
+local usize PCIGetBAR(pci_function* Function, usize Index);
+
+// NOTE(vak): Message signalled interrupts
+//
+// A function with MSI-X gets an interrupt per table entry, each with its
+// own vector and target processor, so a multi-queue device can raise the
+// interrupts of a queue on the processor that serves it. Functions with
+// only MSI get a single interrupt: more messages would need a block of
+// contiguous, aligned vectors that all go to the same processor.
+//
+// Setting up takes over the function's interrupts from INTx. Every
+// entry starts out masked and is unmasked once it has a vector.
+
+#define PCIMaxMSIXCount (2048)
+
+#define PCI_MSI_Control        (0x02)
+#define PCI_MSI_AddressLow     (0x04)
+#define PCI_MSI_AddressHigh    (0x08) // NOTE(vak): 64-bit only
+#define PCI_MSI_Data32         (0x08)
+#define PCI_MSI_Data64         (0x0C)
+#define PCI_MSI_Mask32         (0x0C)
+#define PCI_MSI_Mask64         (0x10)
+
+#define PCI_MSI_Enable         (1 << 0)
+#define PCI_MSI_MessageMask    (0x7 << 4)
+#define PCI_MSI_64Bit          (1 << 7)
+#define PCI_MSI_PerVectorMask  (1 << 8)
+
+#define PCI_MSIX_Control       (0x02)
+#define PCI_MSIX_Table         (0x04)
+
+#define PCI_MSIX_SizeMask      (0x7FF)
+#define PCI_MSIX_FunctionMask  (1 << 14)
+#define PCI_MSIX_Enable        (1 << 15)
+#define PCI_MSIX_BIRMask       (0x7)
+
+#define PCI_MSIX_EntrySize     (16)
+#define PCI_MSIX_EntryAddress  (0x0)
+#define PCI_MSIX_EntryData     (0x8)
+#define PCI_MSIX_EntryControl  (0xC)
+#define PCI_MSIX_EntryMasked   (1 << 0)
+
+typedef struct
+{
+    pci_function* Function;
+    usize         Capability;
+    b32           Extended;    // NOTE(vak): MSI-X
+    usize         Count;       // NOTE(vak): Interrupts that can be set up
+
+    usize         Table;       // NOTE(vak): Virtual address of the MSI-X table
+    usize         TableBase;   // NOTE(vak): Page aligned mapping of it, from the kernel arena
+    usize         TableSize;
+} pci_msi;
+
+// NOTE(vak): Prefers MSI-X over MSI. Fails if the function has neither.
+
+local b32  PCISetupMSI(pci_msi* MSI, pci_function* Function);
+local void PCIDisableMSI(pci_msi* MSI);
+
+// NOTE(vak): Points interrupt Index at Vector on the processor with the
+// given interrupt controller ID, and unmasks it.
+
+local b32  PCISetMSIVector(pci_msi* MSI, usize Index, u32 TargetID, usize Vector);
+local void PCIMaskMSIVector(pci_msi* MSI, usize Index);
+
+// NOTE(vak): Allocates a vector for Handler and points interrupt Index
+// at it. Returns the vector, or 0 if it failed.
+
+local usize PCIAllocateMSIVector(
+    pci_msi*                MSI,
+    usize                   Index,
+    u32                     TargetID,
+    arch_interrupt_handler* Handler,
+    void*                   Context
+);
+
+local void PCIReleaseMSIVector(pci_msi* MSI, usize Index, usize Vector);
@@ -138,7 +138,8 @@ local void PrintfPushNumber(
     if (Base < 2)  return;
     if (Base > 16) return;
 
-    persist char Buffer[65] = {0};
+    char Buffer[65] = {0}; // NOTE(vak): On the stack, so that printing is reentrant
+
     persist char DigitMapLower[] = "0123456789abcdef";
     persist char DigitMapUpper[] = "0123456789ABCDEF";
 
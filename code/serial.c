@@ -1,13 +1,43 @@
+// NOTE(vak): Every processor formats into a buffer of its own. A print
+// from an exception or NMI that arrives while the buffer is in use
+// formats into a small buffer on the stack instead. Nothing here may
+// allocate, the allocators report their errors through it.
+
+local char  SerialBuffers[ArchMaxCPUCount][SerialBufferSize];
+local usize SerialDepths[ArchMaxCPUCount];
 
 local usize SerialPrintfv(string Format, va_list ArgList)
 {
     usize BytesWritten = 0;
 
-    persist char Buffer[KB(4)] = {0};
+    char Nested[SerialNestedSize];
+
+    // NOTE(vak): Interrupts are only held back while claiming the buffer
+    // and formatting, not during the slow write to the port.
+
+    b32   Enabled = ArchDisableInterrupts();
+    usize CPU     = ArchGetCPUIndex();
+    usize Depth   = SerialDepths[CPU]++;
+
+    char* Buffer     = (Depth) ? (Nested)         : (SerialBuffers[CPU]);
+    usize BufferSize = (Depth) ? (sizeof(Nested)) : (SerialBufferSize);
+
+    BytesWritten = SPrintfv(Buffer, BufferSize, Format, ArgList);
+
+    ArchRestoreInterrupts(Enabled);
 
-    BytesWritten = SPrintfv(Buffer, sizeof(Buffer), Format, ArgList);
     ArchWriteSerial(Buffer, BytesWritten);
 
+    if (BytesWritten == BufferSize)
+    {
+        char Truncated[] = " [truncated]";
+        ArchWriteSerial(Truncated, sizeof(Truncated) - 1);
+    }
+
+    Enabled = ArchDisableInterrupts();
+    SerialDepths[CPU]--;
+    ArchRestoreInterrupts(Enabled);
+
     return (BytesWritten);
 }
 
@@ -1,6 +1,9 @@
 
 #pragma once
 
+#define SerialBufferSize (KB(4))
+#define SerialNestedSize (256) // NOTE(vak): For prints from within another print
+
 local usize SerialPrintfv(string Format, va_list ArgList);
 local usize SerialPrintf(string Format, ...);
 
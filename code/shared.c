@@ -3,7 +3,29 @@
 
 local void ZeroMemory(void* DestInit, usize Size)
 {
+    typedef usize __attribute__((__may_alias__)) word;
+
     u8* Dest = (u8*)DestInit;
+
+    // NOTE(vak): Store single bytes up to a word boundary, then whole
+    // words, then whatever bytes are left.
+
+    while (Size && ((usize)Dest & (sizeof(word) - 1)))
+    {
+        *Dest++ = 0;
+        Size--;
+    }
+
+    word* Words = (word*)Dest;
+
+    while (Size >= sizeof(word))
+    {
+        *Words++ = 0;
+        Size -= sizeof(word);
+    }
+
+    Dest = (u8*)Words;
+
     while (Size--)
         *Dest++ = 0;
 }
@@ -22,3 +44,26 @@ local void CopyMemory(void* DestInit, void* SourceInit, usize Size)
     while (Size--)
         *Dest++ = *Source++;
 }
+
+// NOTE(vak): Spin lock
+
+local void AcquireLock(spin_lock* Lock)
+{
+    while (__atomic_exchange_n(&Lock->Locked, 1, __ATOMIC_ACQUIRE))
+    {
+        // NOTE(vak): Wait with plain reads, so that the cache line
+        // isn't bounced between processors while the lock is held.
+
+        while (Lock->Locked)
+        {
+#if x86_64
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+}
+
+local void ReleaseLock(spin_lock* Lock)
+{
+    __atomic_store_n(&Lock->Locked, 0, __ATOMIC_RELEASE);
+}
@@ -137,6 +137,16 @@ local void CopyMemory(void* DestInit, void* SourceInit, usize Size);
 #define ZeroType(Pointer)         ZeroMemory(Pointer, sizeof(*(Pointer)))
 #define ZeroArray(Pointer, Count) ZeroMemory(Pointer, sizeof(*(Pointer)) * (Count))
 
+// NOTE(vak): Spin lock
+
+typedef struct
+{
+    volatile u32 Locked;
+} spin_lock;
+
+local void AcquireLock(spin_lock* Lock);
+local void ReleaseLock(spin_lock* Lock);
+
 // NOTE(vak): String
 
 typedef struct
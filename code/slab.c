@@ -0,0 +1,290 @@
+local slab_cache* SlabCaches    = 0;
+local spin_lock   SlabCacheLock = {0};
+
+local slab_cache* CreateSlabCache(
+    string            Name,
+    usize             ObjectSize,
+    usize             Alignment,
+    slab_constructor* Constructor
+)
+{
+    slab_cache* Result = 0;
+
+    usize PageSize = ArchGetPageSize();
+
+    Alignment = Maximum(Alignment, sizeof(void*));
+
+    if (Alignment & (Alignment - 1))
+    {
+        SerialErrorf(Str("Slab cache '%str' has an alignment of %usize, which isn't a power of 2."), Name, Alignment);
+    }
+    else
+    {
+        // NOTE(vak): The magazines make a cache too large to live in a
+        // slab of its own, so caches take whole pages.
+
+        usize Order   = GetFrameOrder(sizeof(slab_cache));
+        usize Address = ReservePages(Order);
+
+        if (Address)
+        {
+            Result = (slab_cache*)PhysicalToVirtual(Address);
+            ZeroType(Result);
+
+            CountPages(MemoryUsage_Slabs, (ssize)(1) << Order);
+
+            Result->Name         = Name;
+            Result->Constructor  = Constructor;
+            Result->ObjectSize   = ObjectSize;
+            Result->LinkOffset   = (Constructor) ? Align(ObjectSize, sizeof(void*)) : 0;
+            Result->ObjectStride = Align(Maximum(Result->LinkOffset + sizeof(void*), ObjectSize), Alignment);
+            Result->ColorStep    = Maximum(Alignment, SlabColorSize);
+            Result->HeaderSize   = Align(sizeof(slab), Result->ColorStep);
+
+            // NOTE(vak): Pick the smallest slab that holds enough objects,
+            // whatever is left over is used for coloring.
+
+            usize SlabOrder = 0;
+
+            for (;;)
+            {
+                usize Space = (PageSize << SlabOrder) - Result->HeaderSize;
+
+                if ((Space / Result->ObjectStride >= SlabMinObjects) || (SlabOrder + 1 == FrameOrderCount))
+                    break;
+
+                SlabOrder++;
+            }
+
+            usize SlabSize = PageSize << SlabOrder;
+            usize Space    = SlabSize - Result->HeaderSize;
+
+            Result->SlabOrder      = SlabOrder;
+            Result->ObjectsPerSlab = Space / Result->ObjectStride;
+            Result->ColorCount     = (Space % Result->ObjectStride) / Result->ColorStep + 1;
+
+            b32 Enabled = ArchDisableInterrupts();
+            AcquireLock(&SlabCacheLock);
+
+            Result->Next = SlabCaches;
+            SlabCaches = Result;
+
+            ReleaseLock(&SlabCacheLock);
+            ArchRestoreInterrupts(Enabled);
+
+            SerialDebugf(
+                Str("Slab cache '%str': %usize byte objects, %usize per %usize KB slab, %usize colors."),
+                Name,
+                ObjectSize,
+                Result->ObjectsPerSlab,
+                SlabSize >> 10,
+                Result->ColorCount
+            );
+        }
+    }
+
+    return (Result);
+}
+
+local void** SlabGetLink(slab_cache* Cache, void* Object)
+{
+    void** Result = (void**)((u8*)Object + Cache->LinkOffset);
+    return (Result);
+}
+
+local slab** SlabGetList(slab_cache* Cache, usize UsedCount)
+{
+    slab** Result = &Cache->Partial;
+
+    if (UsedCount == 0)
+    {
+        Result = &Cache->Empty;
+    }
+    else if (UsedCount == Cache->ObjectsPerSlab)
+    {
+        Result = &Cache->Full;
+    }
+
+    return (Result);
+}
+
+local void SlabLink(slab** List, slab* Slab)
+{
+    Slab->Prev = 0;
+    Slab->Next = *List;
+
+    if (Slab->Next)
+        Slab->Next->Prev = Slab;
+
+    *List = Slab;
+}
+
+local void SlabUnlink(slab** List, slab* Slab)
+{
+    if (Slab->Prev)
+        Slab->Prev->Next = Slab->Next;
+    else
+        *List = Slab->Next;
+
+    if (Slab->Next)
+        Slab->Next->Prev = Slab->Prev;
+}
+
+local slab* SlabCreate(slab_cache* Cache)
+{
+    slab* Result = 0;
+
+    usize Address = ReservePages(Cache->SlabOrder);
+
+    if (Address)
+    {
+        Result = (slab*)PhysicalToVirtual(Address);
+        ZeroType(Result);
+
+        CountPages(MemoryUsage_Slabs, (ssize)(1) << Cache->SlabOrder);
+
+        Result->Cache = Cache;
+
+        u8* Objects = (u8*)Result + Cache->HeaderSize + Cache->NextColor * Cache->ColorStep;
+        Cache->NextColor = (Cache->NextColor + 1) % Cache->ColorCount;
+
+        // NOTE(vak): Build the free list backwards, so that objects are
+        // handed out in address order.
+
+        for (usize Index = Cache->ObjectsPerSlab; Index-- > 0;)
+        {
+            void* Object = Objects + Index * Cache->ObjectStride;
+
+            if (Cache->Constructor)
+                Cache->Constructor(Object);
+
+            *SlabGetLink(Cache, Object) = Result->FreeList;
+            Result->FreeList = Object;
+        }
+
+        Cache->SlabCount++;
+    }
+
+    return (Result);
+}
+
+// NOTE(vak): SlabTake and SlabPut move single objects in and out of the
+// slabs, with the cache lock held.
+
+local void* SlabTake(slab_cache* Cache)
+{
+    void* Result = 0;
+
+    slab* Slab = (Cache->Partial) ? (Cache->Partial) : (Cache->Empty);
+
+    if (!Slab)
+    {
+        Slab = SlabCreate(Cache);
+
+        if (Slab)
+            SlabLink(&Cache->Empty, Slab);
+    }
+
+    if (Slab)
+    {
+        SlabUnlink(SlabGetList(Cache, Slab->UsedCount), Slab);
+
+        Result = Slab->FreeList;
+        Slab->FreeList = *SlabGetLink(Cache, Result);
+        Slab->UsedCount++;
+
+        SlabLink(SlabGetList(Cache, Slab->UsedCount), Slab);
+
+        Cache->UsedCount++;
+    }
+
+    return (Result);
+}
+
+local void SlabPut(slab_cache* Cache, void* Object)
+{
+    usize SlabSize = ArchGetPageSize() << Cache->SlabOrder;
+    slab* Slab     = (slab*)((usize)Object & ~(SlabSize - 1));
+
+    SlabUnlink(SlabGetList(Cache, Slab->UsedCount), Slab);
+
+    *SlabGetLink(Cache, Object) = Slab->FreeList;
+    Slab->FreeList = Object;
+    Slab->UsedCount--;
+
+    Cache->UsedCount--;
+
+    if ((Slab->UsedCount == 0) && Cache->Empty)
+    {
+        // NOTE(vak): Keep a single empty slab around, so that a cache
+        // that hovers around a slab boundary doesn't keep creating and
+        // releasing slabs.
+
+        Cache->SlabCount--;
+        ReleasePages(VirtualToPhysical(Slab), Cache->SlabOrder);
+        CountPages(MemoryUsage_Slabs, -((ssize)(1) << Cache->SlabOrder));
+    }
+    else
+    {
+        SlabLink(SlabGetList(Cache, Slab->UsedCount), Slab);
+    }
+}
+
+local void* SlabAllocate(slab_cache* Cache)
+{
+    void* Result = 0;
+
+    b32            Enabled  = ArchDisableInterrupts();
+    slab_magazine* Magazine = Cache->Magazines + ArchGetCPUIndex();
+
+    if (!Magazine->Count)
+    {
+        AcquireLock(&Cache->Lock);
+
+        while (Magazine->Count < SlabMagazineSize / 2)
+        {
+            void* Object = SlabTake(Cache);
+            if (!Object)
+                break;
+
+            Magazine->Objects[Magazine->Count++] = Object;
+        }
+
+        ReleaseLock(&Cache->Lock);
+    }
+
+    if (Magazine->Count)
+        Result = Magazine->Objects[--Magazine->Count];
+
+    ArchRestoreInterrupts(Enabled);
+
+    if (!Result)
+    {
+        SerialErrorf(Str("Unable to allocate from slab cache '%str'."), Cache->Name);
+    }
+
+    return (Result);
+}
+
+local void SlabFree(slab_cache* Cache, void* Object)
+{
+    if (Object)
+    {
+        b32            Enabled  = ArchDisableInterrupts();
+        slab_magazine* Magazine = Cache->Magazines + ArchGetCPUIndex();
+
+        if (Magazine->Count == SlabMagazineSize)
+        {
+            AcquireLock(&Cache->Lock);
+
+            while (Magazine->Count > SlabMagazineSize / 2)
+                SlabPut(Cache, Magazine->Objects[--Magazine->Count]);
+
+            ReleaseLock(&Cache->Lock);
+        }
+
+        Magazine->Objects[Magazine->Count++] = Object;
+
+        ArchRestoreInterrupts(Enabled);
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+// NOTE(vak): Slab allocator
+//
+// Objects of one size are handed out by a named cache. A cache carves
+// slabs, blocks of contiguous pages from the frame allocator, into
+// objects. The slab header sits at the start of the block, so the slab
+// of an object is found by aligning its address down. Consecutive slabs
+// start their objects at different multiples of the cache line size
+// (colors), so that the same objects of different slabs don't all
+// compete for the same cache sets.
+//
+// A constructor runs once for every object when its slab is created,
+// not on every allocation. Objects have to be freed in their constructed
+// state. Free objects are linked through their first word, unless the
+// cache has a constructor, in which case the link is kept behind the
+// object so that it doesn't disturb the constructed state.
+//
+// Every processor has a magazine of objects per cache, which serves
+// most allocations and frees without taking the cache lock. An empty
+// magazine is refilled with half of its size from the slabs, a full one
+// flushes half of its objects back.
+//
+// Slabs are reached through the direct map, so caches can only be used
+// once the kernel page map is active.
+
+typedef void slab_constructor(void* Object);
+
+typedef struct slab_cache slab_cache;
+
+typedef struct slab slab;
+struct slab
+{
+    slab*       Next;
+    slab*       Prev;
+    slab_cache* Cache;
+
+    void*       FreeList;
+    usize       UsedCount;
+};
+
+#define SlabMagazineSize (16)
+#define SlabMinObjects   (8)  // NOTE(vak): Per slab, picks the slab size
+#define SlabColorSize    (64) // NOTE(vak): Cache line size
+
+typedef struct
+{
+    _Alignas(64) usize Count;
+
+    void* Objects[SlabMagazineSize];
+} slab_magazine;
+
+struct slab_cache
+{
+    string            Name;
+    slab_constructor* Constructor;
+
+    usize             ObjectSize;
+    usize             ObjectStride;
+    usize             LinkOffset;
+    usize             HeaderSize;
+    usize             SlabOrder;
+    usize             ObjectsPerSlab;
+    usize             ColorStep;
+    usize             ColorCount;
+    usize             NextColor;
+
+    spin_lock         Lock;
+    slab*             Partial;
+    slab*             Full;
+    slab*             Empty;
+
+    usize             SlabCount;
+    usize             UsedCount; // NOTE(vak): Objects handed out by the slabs, including the magazines
+
+    slab_cache*       Next;      // NOTE(vak): All caches
+
+    slab_magazine     Magazines[ArchMaxCPUCount];
+};
+
+local slab_cache* CreateSlabCache(
+    string            Name,
+    usize             ObjectSize,
+    usize             Alignment,
+    slab_constructor* Constructor
+);
+
+local void* SlabAllocate(slab_cache* Cache);
+local void  SlabFree(slab_cache* Cache, void* Object);
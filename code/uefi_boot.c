@@ -5,6 +5,12 @@
 #include "serial.h"
 #include "memory.h"
 #include "arch.h"
+#include "slab.h"
+#include "heap.h"
+#include "dma.h"
+#include "vmem.h"
+#include "virtual.h"
+#include "pci.h"
 #include "kernel.h"
 
 #include "shared.c"
@@ -12,6 +18,12 @@
 #include "printf.c"
 #include "serial.c"
 #include "memory.c"
+#include "slab.c"
+#include "heap.c"
+#include "dma.c"
+#include "vmem.c"
+#include "virtual.c"
+#include "pci.c"
 #include "arch.c"
 #include "kernel.c"
 
@@ -90,8 +102,9 @@ local void UEFIFree(EFI_SYSTEM_TABLE* SystemTable, void* Buffer)
 }
 
 local memory_map UEFIObtainMemoryMap(
-    EFI_SYSTEM_TABLE*       SystemTable,
-    UINTN*                  MemoryMapKey
+    EFI_SYSTEM_TABLE*        SystemTable,
+    uefi_memory_map_buffers* Buffers,
+    UINTN*                   MemoryMapKey
 )
 {
     EFI_BOOT_SERVICES* BootServices = SystemTable->BootServices;
@@ -99,15 +112,16 @@ local memory_map UEFIObtainMemoryMap(
     memory_map Result = {0};
 
     usize MemoryMapSize     = 0;
-    void* MemoryDescriptors = 0;
     usize DescriptorSize    = 0;
     u32   DescriptorVersion = 0;
 
     for (;;)
     {
+        MemoryMapSize = Buffers->Size;
+
         EFI_STATUS Status = BootServices->GetMemoryMap(
             &MemoryMapSize,
-            MemoryDescriptors,
+            Buffers->Descriptors,
             MemoryMapKey,
             &DescriptorSize,
             &DescriptorVersion
@@ -119,17 +133,19 @@ local memory_map UEFIObtainMemoryMap(
         }
         else if (Status == EFI_BUFFER_TOO_SMALL)
         {
-            usize NewSize  = MemoryMapSize + 4*DescriptorSize;
-            usize NewCount = NewSize / DescriptorSize;
+            // NOTE(vak): Allocating the buffers can split a free region
+            // and grow the memory map, and so can later allocations, so
+            // leave room for a few more descriptors.
 
-            if (MemoryDescriptors)
-                UEFIFree(SystemTable, MemoryDescriptors);
+            usize NewSize  = MemoryMapSize + 16*DescriptorSize;
+            usize NewCount = NewSize / DescriptorSize;
 
-            if (Result.Regions)
-                UEFIFree(SystemTable, Result.Regions);
+            UEFIFree(SystemTable, Buffers->Descriptors);
+            UEFIFree(SystemTable, Buffers->Regions);
 
-            MemoryDescriptors = UEFIAllocate(SystemTable, NewSize);
-            Result.Regions    = UEFIAllocate(SystemTable, NewCount * sizeof(memory_region));
+            Buffers->Descriptors = UEFIAllocate(SystemTable, NewSize);
+            Buffers->Regions     = UEFIAllocate(SystemTable, NewCount * sizeof(memory_region));
+            Buffers->Size        = NewSize;
         }
         else if (Status == EFI_INVALID_PARAMETER)
         {
@@ -141,10 +157,12 @@ local memory_map UEFIObtainMemoryMap(
         }
     }
 
-    Result.RegionCount = MemoryMapSize / DescriptorSize;
+    Result.Regions        = Buffers->Regions;
+    Result.RegionCount    = MemoryMapSize / DescriptorSize;
+    Result.RegionCapacity = Buffers->Size / DescriptorSize;
     ZeroArray(Result.Regions, Result.RegionCount);
 
-    u8* Base = (u8*)MemoryDescriptors;
+    u8* Base = (u8*)Buffers->Descriptors;
 
     for (usize Index = 0; Index < Result.RegionCount; Index++)
     {
@@ -160,31 +178,185 @@ local memory_map UEFIObtainMemoryMap(
             default: {} break;
 
             case EfiLoaderCode:
-            case EfiBootServicesCode:
             {
                 Region->Kind = MemoryRegionKind_BootCode;
             } break;
 
             case EfiLoaderData:
-            case EfiBootServicesData:
             {
                 Region->Kind = MemoryRegionKind_BootData;
             } break;
 
+            case EfiBootServicesCode:
+            case EfiBootServicesData:
+            {
+                Region->Kind = MemoryRegionKind_Reclaimable;
+            } break;
+
             case EfiRuntimeServicesCode:
             case EfiRuntimeServicesData:
+            {
+                Region->Kind = MemoryRegionKind_Runtime;
+            } break;
+
             case EfiConventionalMemory:
             {
                 Region->Kind = MemoryRegionKind_Usable;
             } break;
+
+            case EfiMemoryMappedIO:
+            case EfiMemoryMappedIOPortSpace:
+            {
+                Region->Kind = MemoryRegionKind_Device;
+            } break;
+
+            case EFI_KERNEL_PAGE_TABLES_MEMORY_TYPE:
+            {
+                Region->Kind = MemoryRegionKind_PageTables;
+            } break;
         }
 
         Base += DescriptorSize;
     }
 
+    NormalizeMemoryMap(&Result);
+
     return (Result);
 }
 
+local image_map UEFIObtainImageMap(
+    EFI_SYSTEM_TABLE*       SystemTable,
+    EFI_HANDLE              ImageHandle
+)
+{
+    EFI_BOOT_SERVICES* BootServices = SystemTable->BootServices;
+
+    image_map Result = {0};
+
+    EFI_GUID                   Protocol    = EFI_LOADED_IMAGE_PROTOCOL_GUID;
+    EFI_LOADED_IMAGE_PROTOCOL* LoadedImage = 0;
+
+    EFI_STATUS Status = BootServices->HandleProtocol(
+        ImageHandle,
+        &Protocol,
+        (VOID**)&LoadedImage
+    );
+
+    if (Status != EFI_SUCCESS)
+    {
+        UEFIError(SystemTable, L"Unable to obtain the loaded image protocol.");
+    }
+
+    u8* Base = (u8*)LoadedImage->ImageBase;
+
+    Result.BaseAddress = (usize)Base;
+    Result.Size        = LoadedImage->ImageSize;
+
+    // NOTE(vak): Walk the PE/COFF section table of our own image.
+
+    EFI_IMAGE_DOS_HEADER* DOSHeader = (EFI_IMAGE_DOS_HEADER*)Base;
+    EFI_IMAGE_NT_HEADERS* NTHeaders = (EFI_IMAGE_NT_HEADERS*)(Base + DOSHeader->e_lfanew);
+
+    if ((DOSHeader->e_magic != EFI_IMAGE_DOS_SIGNATURE) || (NTHeaders->Signature != EFI_IMAGE_NT_SIGNATURE))
+    {
+        UEFIError(SystemTable, L"Kernel image is not a valid PE/COFF image.");
+    }
+
+    EFI_IMAGE_FILE_HEADER*    FileHeader = &NTHeaders->FileHeader;
+    EFI_IMAGE_SECTION_HEADER* Sections   = (EFI_IMAGE_SECTION_HEADER*)
+        ((u8*)(FileHeader + 1) + FileHeader->SizeOfOptionalHeader);
+
+    usize SectionCount = Minimum(FileHeader->NumberOfSections, ImageMaxSectionCount);
+
+    for (usize Index = 0; Index < SectionCount; Index++)
+    {
+        EFI_IMAGE_SECTION_HEADER* Header  = Sections + Index;
+        image_section*            Section = Result.Sections + Result.SectionCount;
+
+        if (Header->VirtualSize == 0)
+            continue;
+
+        Section->BaseAddress = (usize)(Base + Header->VirtualAddress);
+        Section->Size        = Header->VirtualSize;
+        Section->Flags       = 0;
+
+        if (Header->Characteristics & EFI_IMAGE_SCN_MEM_WRITE)
+            Section->Flags |= ImageSectionFlag_Write;
+
+        if (Header->Characteristics & EFI_IMAGE_SCN_MEM_EXECUTE)
+            Section->Flags |= ImageSectionFlag_Execute;
+
+        Result.SectionCount++;
+    }
+
+    return (Result);
+}
+
+local void UEFIBuildPageMap(
+    EFI_SYSTEM_TABLE*       SystemTable,
+    memory_map*             MemoryMap,
+    image_map*              ImageMap
+)
+{
+    EFI_BOOT_SERVICES* BootServices = SystemTable->BootServices;
+
+    usize PageSize = ArchGetPageSize();
+
+    // NOTE(vak): Reserve enough page tables for the whole kernel page
+    // map in one go: the direct map, the identity mapped boot regions
+    // and the kernel image, which is mapped with 4KB pages.
+
+    usize TableCount = ArchGetPageTableBound(Align(ImageMap->Size, PageSize), false);
+
+    for (usize Index = 0; Index < MemoryMap->RegionCount; Index++)
+    {
+        memory_region* Region = MemoryMap->Regions + Index;
+
+        usize Size = Region->PageCount * PageSize;
+
+        TableCount += ArchGetPageTableBound(Size, true);
+
+        b32 Boot = (
+            (Region->Kind == MemoryRegionKind_BootCode) ||
+            (Region->Kind == MemoryRegionKind_BootData) ||
+            (Region->Kind == MemoryRegionKind_Reclaimable)
+        );
+
+        if (Boot)
+            TableCount += ArchGetPageTableBound(Size, true);
+    }
+
+    EFI_PHYSICAL_ADDRESS Tables = 0;
+
+    EFI_STATUS Status = BootServices->AllocatePages(
+        AllocateAnyPages,
+        EFI_KERNEL_PAGE_TABLES_MEMORY_TYPE,
+        TableCount,
+        &Tables
+    );
+
+    if (Status == EFI_OUT_OF_RESOURCES)
+    {
+        UEFIError(SystemTable, L"Ran out of memory for the kernel page tables.");
+    }
+    else if (Status != EFI_SUCCESS)
+    {
+        UEFIError(SystemTable, L"Unknown error returned by BootServices->AllocatePages().");
+    }
+
+    // NOTE(vak): The page tables themselves aren't in the memory map
+    // yet, but the memory they were taken from is, so they end up in
+    // the direct map.
+
+    ArchSetPageTablePool(Tables, TableCount * PageSize);
+
+    arch_page_map* PageMap = ArchGetKernelPageMap();
+
+    MapPhysicalMemory(PageMap, MemoryMap);
+    MapBootMemory(PageMap, MemoryMap);
+    MapKernelImage(PageMap, ImageMap);
+}
+
 local b32 UEFISameGUID(EFI_GUID* A, EFI_GUID* B)
 {
     u64* PartsA = (u64*)A;
@@ -263,11 +435,32 @@ EFI_STATUS EFIAPI UEFIBoot(
 )
 {
     UEFISetupConsole(SystemTable);
+    ArchDetectFeatures();
+
+    image_map ImageMap = UEFIObtainImageMap(
+        SystemTable,
+        ImageHandle
+    );
 
     UINTN MemoryMapKey = 0;
 
+    uefi_memory_map_buffers Buffers = {0};
+
+    // NOTE(vak): Build the kernel page map while the firmware can still
+    // hand out memory, then fetch the final memory map, which includes
+    // the page tables. Both memory maps share the same buffers.
+
+    memory_map BootMemoryMap = UEFIObtainMemoryMap(
+        SystemTable,
+        &Buffers,
+        &MemoryMapKey
+    );
+
+    UEFIBuildPageMap(SystemTable, &BootMemoryMap, &ImageMap);
+
     memory_map MemoryMap = UEFIObtainMemoryMap(
         SystemTable,
+        &Buffers,
         &MemoryMapKey
     );
 
@@ -252,6 +252,26 @@ typedef EFI_STATUS (EFIAPI *EFI_GET_MEMORY_MAP)
     OUT UINT32*                 DescriptorVersion
 );
 
+typedef enum {
+    AllocateAnyPages,
+    AllocateMaxAddress,
+    AllocateAddress,
+    MaxAllocateType,
+} EFI_ALLOCATE_TYPE;
+
+// NOTE(vak): Memory types from 0x80000000 on are reserved for use by
+// the operating system loader.
+
+#define EFI_KERNEL_PAGE_TABLES_MEMORY_TYPE ((EFI_MEMORY_TYPE)(0x80000000))
+
+typedef EFI_STATUS (EFIAPI *EFI_ALLOCATE_PAGES)
+(
+    IN EFI_ALLOCATE_TYPE        Type,
+    IN EFI_MEMORY_TYPE          MemoryType,
+    IN UINTN                    Pages,
+    IN OUT EFI_PHYSICAL_ADDRESS* Memory
+);
+
 typedef EFI_STATUS (EFIAPI *EFI_ALLOCATE_POOL)
 (
     IN EFI_MEMORY_TYPE          PoolType,
@@ -264,6 +284,13 @@ typedef EFI_STATUS (EFIAPI* EFI_FREE_POOL)
     IN VOID*                    Buffer
 );
 
+typedef EFI_STATUS (EFIAPI* EFI_HANDLE_PROTOCOL)
+(
+    IN EFI_HANDLE               Handle,
+    IN EFI_GUID*                Protocol,
+    OUT VOID**                  Interface
+);
+
 typedef EFI_STATUS (EFIAPI* EFI_EXIT_BOOT_SERVICES)
 (
     IN EFI_HANDLE               ImageHandle,
@@ -277,7 +304,7 @@ typedef struct
     VOID*                   RaiseTPL;
     VOID*                   RestoreTPL;
 
-    VOID*                   AllocatePages;
+    EFI_ALLOCATE_PAGES      AllocatePages;
     VOID*                   FreePages;
     EFI_GET_MEMORY_MAP      GetMemoryMap;
     EFI_ALLOCATE_POOL       AllocatePool;
@@ -293,7 +320,7 @@ typedef struct
     VOID*                   InstallProtocolInterface;
     VOID*                   ReinstallProtocolInterface;
     VOID*                   UninstallProtocolInterface;
-    VOID*                   HandleProtocol;
+    EFI_HANDLE_PROTOCOL     HandleProtocol;
     VOID*                   Reserved;
     VOID*                   RegisterProtocolNotify;
     VOID*                   LocateHandle;
@@ -355,3 +382,89 @@ typedef struct
     UINTN                               NumberOfTableEntries;
     EFI_CONFIGURATION_TABLE*            ConfigurationTable;
 } EFI_SYSTEM_TABLE;
+
+// NOTE(vak): Loaded image protocol
+
+#define EFI_LOADED_IMAGE_PROTOCOL_GUID (EFI_GUID) \
+    {0x5b1b31a1,0x9562,0x11d2,\
+    {0x8e,0x3f,0x00,0xa0,0xc9,0x69,0x72,0x3b}}
+
+typedef struct
+{
+    UINT32              Revision;
+    EFI_HANDLE          ParentHandle;
+    EFI_SYSTEM_TABLE*   SystemTable;
+
+    EFI_HANDLE          DeviceHandle;
+    VOID*               FilePath;
+    VOID*               Reserved;
+
+    UINT32              LoadOptionsSize;
+    VOID*               LoadOptions;
+
+    VOID*               ImageBase;
+    UINT64              ImageSize;
+    EFI_MEMORY_TYPE     ImageCodeType;
+    EFI_MEMORY_TYPE     ImageDataType;
+    VOID*               Unload;
+} EFI_LOADED_IMAGE_PROTOCOL;
+
+// NOTE(vak): PE/COFF image headers, only the parts that are used
+
+#define EFI_IMAGE_DOS_SIGNATURE     (0x5A4D)     // NOTE(vak): "MZ"
+#define EFI_IMAGE_NT_SIGNATURE      (0x00004550) // NOTE(vak): "PE\0\0"
+
+#define EFI_IMAGE_SCN_MEM_EXECUTE   (0x20000000)
+#define EFI_IMAGE_SCN_MEM_READ      (0x40000000)
+#define EFI_IMAGE_SCN_MEM_WRITE     (0x80000000)
+
+typedef struct
+{
+    UINT16  e_magic;
+    UINT16  Unused[29];
+    UINT32  e_lfanew;
+} EFI_IMAGE_DOS_HEADER;
+
+typedef struct
+{
+    UINT16  Machine;
+    UINT16  NumberOfSections;
+    UINT32  TimeDateStamp;
+    UINT32  PointerToSymbolTable;
+    UINT32  NumberOfSymbols;
+    UINT16  SizeOfOptionalHeader;
+    UINT16  Characteristics;
+} EFI_IMAGE_FILE_HEADER;
+
+typedef struct
+{
+    UINT32                  Signature;
+    EFI_IMAGE_FILE_HEADER   FileHeader;
+
+    // NOTE(vak): Followed by the optional header
+} EFI_IMAGE_NT_HEADERS;
+
+typedef struct
+{
+    UINT8   Name[8];
+    UINT32  VirtualSize;
+    UINT32  VirtualAddress;
+    UINT32  SizeOfRawData;
+    UINT32  PointerToRawData;
+    UINT32  PointerToRelocations;
+    UINT32  PointerToLinenumbers;
+    UINT16  NumberOfRelocations;
+    UINT16  NumberOfLinenumbers;
+    UINT32  Characteristics;
+} EFI_IMAGE_SECTION_HEADER;
+
+// NOTE(vak): Buffers for the memory map, kept across calls to
+// UEFIObtainMemoryMap so that they only have to be allocated again
+// when the memory map outgrows them.
+
+typedef struct
+{
+    EFI_MEMORY_DESCRIPTOR* Descriptors;
+    memory_region*         Regions;
+    usize                  Size;
+} uefi_memory_map_buffers;
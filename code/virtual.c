@@ -0,0 +1,344 @@
+local address_space  KernelAddressSpace  = {0};
+local address_space* CurrentAddressSpace = 0;
+
+local slab_cache* VirtualRegionCache = 0;
+local u32         VirtualRegionSeed  = 0x9E3779B9;
+
+local void SetupKernelAddressSpace(arch_page_map* PageMap)
+{
+    KernelAddressSpace.PageMap = PageMap;
+    KernelAddressSpace.Root    = 0;
+
+    CurrentAddressSpace = &KernelAddressSpace;
+}
+
+local address_space* GetKernelAddressSpace(void)
+{
+    return (&KernelAddressSpace);
+}
+
+local address_space* GetCurrentAddressSpace(void)
+{
+    return (CurrentAddressSpace);
+}
+
+local void UseAddressSpace(address_space* Space)
+{
+    ArchUsePageMap(Space->PageMap);
+    CurrentAddressSpace = Space;
+}
+
+local virtual_region* NewVirtualRegion(void)
+{
+    if (!VirtualRegionCache)
+        VirtualRegionCache = CreateSlabCache(Str("virtual_region"), sizeof(virtual_region), 0, 0);
+
+    virtual_region* Region = (virtual_region*)SlabAllocate(VirtualRegionCache);
+
+    if (Region)
+    {
+        ZeroType(Region);
+
+        // NOTE(vak): Xorshift, treap priorities only need to look random.
+
+        VirtualRegionSeed ^= VirtualRegionSeed << 13;
+        VirtualRegionSeed ^= VirtualRegionSeed >> 17;
+        VirtualRegionSeed ^= VirtualRegionSeed << 5;
+
+        Region->Priority = VirtualRegionSeed;
+    }
+
+    return (Region);
+}
+
+local virtual_region* VirtualRegionMerge(virtual_region* Left, virtual_region* Right)
+{
+    virtual_region* Result = 0;
+
+    if (!Left)
+    {
+        Result = Right;
+    }
+    else if (!Right)
+    {
+        Result = Left;
+    }
+    else if (Left->Priority > Right->Priority)
+    {
+        Left->Right = VirtualRegionMerge(Left->Right, Right);
+        Result = Left;
+    }
+    else
+    {
+        Right->Left = VirtualRegionMerge(Left, Right->Left);
+        Result = Right;
+    }
+
+    return (Result);
+}
+
+// NOTE(vak): Splits a treap into the regions below Address and the
+// regions at or above it.
+
+local void VirtualRegionSplit(
+    virtual_region*  Root,
+    usize            Address,
+    virtual_region** Left,
+    virtual_region** Right
+)
+{
+    if (!Root)
+    {
+        *Left  = 0;
+        *Right = 0;
+    }
+    else if (Root->BaseAddress < Address)
+    {
+        VirtualRegionSplit(Root->Right, Address, &Root->Right, Right);
+        *Left = Root;
+    }
+    else
+    {
+        VirtualRegionSplit(Root->Left, Address, Left, &Root->Left);
+        *Right = Root;
+    }
+}
+
+local virtual_region* FindVirtualRegion(address_space* Space, usize Address)
+{
+    virtual_region* Result = 0;
+    virtual_region* Node   = Space->Root;
+
+    while (Node)
+    {
+        if (Address < Node->BaseAddress)
+        {
+            Node = Node->Left;
+        }
+        else if (Address - Node->BaseAddress >= Node->Size)
+        {
+            Node = Node->Right;
+        }
+        else
+        {
+            Result = Node;
+            break;
+        }
+    }
+
+    return (Result);
+}
+
+// NOTE(vak): Returns the lowest region that starts at or above Address.
+
+local virtual_region* FindNextVirtualRegion(address_space* Space, usize Address)
+{
+    virtual_region* Result = 0;
+    virtual_region* Node   = Space->Root;
+
+    while (Node)
+    {
+        if (Node->BaseAddress >= Address)
+        {
+            Result = Node;
+            Node   = Node->Left;
+        }
+        else
+        {
+            Node = Node->Right;
+        }
+    }
+
+    return (Result);
+}
+
+local virtual_region* InsertVirtualRegion(
+    address_space*      Space,
+    usize               BaseAddress,
+    usize               Size,
+    virtual_region_kind Kind,
+    usize               PhysicalAddress,
+    arch_map_flags      Flags
+)
+{
+    virtual_region* Result = 0;
+
+    usize PageSize = ArchGetPageSize();
+
+    b32 Enabled = ArchDisableInterrupts();
+    AcquireLock(&Space->Lock);
+
+    virtual_region* Next = FindNextVirtualRegion(Space, BaseAddress);
+
+    b32 Overlaps = (
+        FindVirtualRegion(Space, BaseAddress) ||
+        (Next && (Next->BaseAddress - BaseAddress < Size))
+    );
+
+    if ((BaseAddress | Size | PhysicalAddress) & (PageSize - 1))
+    {
+        SerialErrorf(Str("Misaligned virtual region at 0x%p (%usize bytes)."), BaseAddress, Size);
+    }
+    else if (!Size || (BaseAddress + Size < BaseAddress))
+    {
+        SerialErrorf(Str("Invalid virtual region at 0x%p (%usize bytes)."), BaseAddress, Size);
+    }
+    else if (Overlaps)
+    {
+        SerialErrorf(Str("Virtual region at 0x%p (%usize bytes) overlaps another."), BaseAddress, Size);
+    }
+    else
+    {
+        Result = NewVirtualRegion();
+    }
+
+    if (Result)
+    {
+        Result->BaseAddress     = BaseAddress;
+        Result->Size            = Size;
+        Result->Kind            = Kind;
+        Result->Flags           = Flags;
+        Result->PhysicalAddress = PhysicalAddress;
+
+        virtual_region* Left  = 0;
+        virtual_region* Right = 0;
+
+        VirtualRegionSplit(Space->Root, BaseAddress, &Left, &Right);
+        Space->Root = VirtualRegionMerge(VirtualRegionMerge(Left, Result), Right);
+    }
+
+    ReleaseLock(&Space->Lock);
+    ArchRestoreInterrupts(Enabled);
+
+    return (Result);
+}
+
+local virtual_region* ReserveVirtualRegion(
+    address_space* Space,
+    usize          BaseAddress,
+    usize          Size,
+    arch_map_flags Flags
+)
+{
+    virtual_region* Result = InsertVirtualRegion(
+        Space,
+        BaseAddress,
+        Size,
+        VirtualRegionKind_Anonymous,
+        0,
+        Flags
+    );
+
+    return (Result);
+}
+
+local virtual_region* ReservePhysicalRegion(
+    address_space* Space,
+    usize          BaseAddress,
+    usize          Size,
+    usize          PhysicalAddress,
+    arch_map_flags Flags
+)
+{
+    virtual_region* Result = InsertVirtualRegion(
+        Space,
+        BaseAddress,
+        Size,
+        VirtualRegionKind_Physical,
+        PhysicalAddress,
+        Flags
+    );
+
+    return (Result);
+}
+
+local void ReleaseVirtualRegion(address_space* Space, virtual_region* Region)
+{
+    // NOTE(vak): Cut the region out of the treap.
+
+    virtual_region* Left   = 0;
+    virtual_region* Middle = 0;
+    virtual_region* Right  = 0;
+
+    b32 Enabled = ArchDisableInterrupts();
+    AcquireLock(&Space->Lock);
+
+    VirtualRegionSplit(Space->Root, Region->BaseAddress, &Left, &Right);
+    VirtualRegionSplit(Right, Region->BaseAddress + 1, &Middle, &Right);
+
+    Space->Root = VirtualRegionMerge(Left, Right);
+
+    // NOTE(vak): Anonymous pages belong to the region, so they go back
+    // to the frame allocator along with the mappings.
+
+    b32   ReleaseFrames = (Region->Kind == VirtualRegionKind_Anonymous);
+    usize Released      = ArchUnmapRange(Space->PageMap, Region->BaseAddress, Region->Size, ReleaseFrames);
+
+    if (ReleaseFrames)
+        CountPages(MemoryUsage_Anonymous, -(ssize)Released);
+
+    ReleaseLock(&Space->Lock);
+    ArchRestoreInterrupts(Enabled);
+
+    SlabFree(VirtualRegionCache, Region);
+}
+
+local b32 HandlePageFault(usize Address, arch_fault_flags Flags)
+{
+    b32 Handled = false;
+
+    usize PageSize = ArchGetPageSize();
+
+    address_space* Space = CurrentAddressSpace;
+
+    if (Space)
+    {
+        // NOTE(vak): The region can't be released while its page is
+        // being mapped.
+
+        b32 Enabled = ArchDisableInterrupts();
+        AcquireLock(&Space->Lock);
+
+        virtual_region* Region = FindVirtualRegion(Space, Address);
+
+        b32 Allowed = (
+            Region &&
+            !(Flags & ArchFaultFlag_Present) &&
+            (!(Flags & ArchFaultFlag_Write  ) || (Region->Flags & ArchMapFlag_Write  )) &&
+            (!(Flags & ArchFaultFlag_Execute) || (Region->Flags & ArchMapFlag_Execute)) &&
+            (!(Flags & ArchFaultFlag_User   ) || (Region->Flags & ArchMapFlag_User   ))
+        );
+
+        if (Allowed)
+        {
+            usize Virtual  = Address & ~(PageSize - 1);
+            usize Physical = Region->PhysicalAddress + (Virtual - Region->BaseAddress);
+            b32   Backed   = true;
+
+            if (Region->Kind == VirtualRegionKind_Anonymous)
+            {
+                Physical = ReserveZeroedPage();
+                Backed   = (Physical != 0);
+
+                if (Backed)
+                    CountPages(MemoryUsage_Anonymous, 1);
+            }
+
+            if (Backed)
+            {
+                Handled = ArchMapRange(Space->PageMap, Physical, Virtual, PageSize, Region->Flags);
+
+                if (!Handled && (Region->Kind == VirtualRegionKind_Anonymous))
+                {
+                    ReleasePage(Physical);
+                    CountPages(MemoryUsage_Anonymous, -1);
+                }
+            }
+        }
+
+        ReleaseLock(&Space->Lock);
+        ArchRestoreInterrupts(Enabled);
+    }
+
+    return (Handled);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+// NOTE(vak): Virtual memory regions
+//
+// An address space describes the ranges of virtual memory that may be
+// touched with virtual regions, kept in a treap ordered by address.
+// Reserving a region doesn't back it with memory; pages are mapped by
+// the page fault handler the first time they are touched. Anonymous
+// regions get freshly zeroed pages, physical regions map the matching
+// page of a fixed physical range.
+
+typedef usize virtual_region_kind;
+enum
+{
+    VirtualRegionKind_Anonymous = 0,
+    VirtualRegionKind_Physical,
+};
+
+typedef struct virtual_region virtual_region;
+struct virtual_region
+{
+    usize               BaseAddress;
+    usize               Size;
+    virtual_region_kind Kind;
+    arch_map_flags      Flags;
+    usize               PhysicalAddress; // NOTE(vak): VirtualRegionKind_Physical only
+
+    u32                 Priority;
+    virtual_region*     Left;
+    virtual_region*     Right;
+};
+
+// NOTE(vak): The lock is taken with interrupts disabled, since the page
+// fault handler walks the treap too.
+
+typedef struct
+{
+    spin_lock       Lock;
+    arch_page_map*  PageMap;
+    virtual_region* Root;
+} address_space;
+
+local void           SetupKernelAddressSpace(arch_page_map* PageMap);
+local address_space* GetKernelAddressSpace(void);
+local address_space* GetCurrentAddressSpace(void);
+local void           UseAddressSpace(address_space* Space);
+
+local virtual_region* ReserveVirtualRegion(
+    address_space* Space,
+    usize          BaseAddress,
+    usize          Size,
+    arch_map_flags Flags
+);
+
+local virtual_region* ReservePhysicalRegion(
+    address_space* Space,
+    usize          BaseAddress,
+    usize          Size,
+    usize          PhysicalAddress,
+    arch_map_flags Flags
+);
+
+local void ReleaseVirtualRegion(address_space* Space, virtual_region* Region);
+
+// NOTE(vak): Doesn't lock, the caller has to hold the address space lock
+// or otherwise keep the region from being released.
+
+local virtual_region* FindVirtualRegion(address_space* Space, usize Address);
+
+// NOTE(vak): Called by the architecture layer on a page fault. Returns
+// true if the faulting access can be retried.
+
+local b32 HandlePageFault(usize Address, arch_fault_flags Flags);
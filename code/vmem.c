@@ -0,0 +1,551 @@
+local vmem        KernelArena      = {0};
+local slab_cache* VMemSegmentCache = 0;
+
+local vmem_segment* VMemNewSegment(void)
+{
+    if (!VMemSegmentCache)
+        VMemSegmentCache = CreateSlabCache(Str("vmem_segment"), sizeof(vmem_segment), 0, 0);
+
+    vmem_segment* Result = (vmem_segment*)SlabAllocate(VMemSegmentCache);
+
+    if (Result)
+        ZeroType(Result);
+
+    return (Result);
+}
+
+local void VMemReleaseSegment(vmem_segment* Segment)
+{
+    if (Segment)
+        SlabFree(VMemSegmentCache, Segment);
+}
+
+// NOTE(vak): The arena lock is taken with interrupts disabled, like the
+// frame allocator lock.
+
+local b32 VMemLock(vmem* Arena)
+{
+    b32 Enabled = ArchDisableInterrupts();
+    AcquireLock(&Arena->Lock);
+
+    return (Enabled);
+}
+
+local void VMemUnlock(vmem* Arena, b32 Enabled)
+{
+    ReleaseLock(&Arena->Lock);
+    ArchRestoreInterrupts(Enabled);
+}
+
+// NOTE(vak): Segments of free list N are at least 2^N bytes, and less
+// than 2^(N + 1).
+
+local usize VMemGetListIndex(usize Size)
+{
+    return (63 - __builtin_clzll(Size));
+}
+
+local usize VMemGetHashIndex(vmem* Arena, usize Address)
+{
+    u64 Key = (Address / Arena->Quantum) * (u64)(0x9E3779B97F4A7C15);
+    return (Key >> (64 - VMemHashBits));
+}
+
+local void VMemInsertAfter(vmem_segment* Prev, vmem_segment* Segment)
+{
+    Segment->Prev = Prev;
+    Segment->Next = Prev->Next;
+
+    Prev->Next->Prev = Segment;
+    Prev->Next       = Segment;
+}
+
+local void VMemUnlink(vmem_segment* Segment)
+{
+    Segment->Prev->Next = Segment->Next;
+    Segment->Next->Prev = Segment->Prev;
+}
+
+local void VMemPushList(vmem_segment** List, vmem_segment* Segment)
+{
+    Segment->ListPrev = 0;
+    Segment->ListNext = *List;
+
+    if (*List)
+        (*List)->ListPrev = Segment;
+
+    *List = Segment;
+}
+
+local void VMemRemoveList(vmem_segment** List, vmem_segment* Segment)
+{
+    if (Segment->ListPrev)
+        Segment->ListPrev->ListNext = Segment->ListNext;
+    else
+        *List = Segment->ListNext;
+
+    if (Segment->ListNext)
+        Segment->ListNext->ListPrev = Segment->ListPrev;
+}
+
+local void VMemPushFree(vmem* Arena, vmem_segment* Segment)
+{
+    usize Index = VMemGetListIndex(Segment->Size);
+
+    Segment->Kind = VMemSegmentKind_Free;
+
+    VMemPushList(Arena->FreeLists + Index, Segment);
+    Arena->FreeMap |= (u64)(1) << Index;
+}
+
+local void VMemRemoveFree(vmem* Arena, vmem_segment* Segment)
+{
+    usize Index = VMemGetListIndex(Segment->Size);
+
+    VMemRemoveList(Arena->FreeLists + Index, Segment);
+
+    if (!Arena->FreeLists[Index])
+        Arena->FreeMap &= ~((u64)(1) << Index);
+}
+
+local void VMemCreate(vmem* Arena, string Name, usize Quantum, usize QCacheMax)
+{
+    ZeroType(Arena);
+
+    if (!Quantum || (Quantum & (Quantum - 1)))
+    {
+        SerialErrorf(Str("Arena '%str' has a quantum of %usize, which isn't a power of 2."), Name, Quantum);
+        Quantum = ArchGetPageSize();
+    }
+
+    Arena->Name      = Name;
+    Arena->Quantum   = Quantum;
+    Arena->QCacheMax = Minimum(QCacheMax & ~(Quantum - 1), VMemQCacheCount * Quantum);
+
+    Arena->Segments.Kind = VMemSegmentKind_Span;
+    Arena->Segments.Prev = &Arena->Segments;
+    Arena->Segments.Next = &Arena->Segments;
+}
+
+local b32 VMemAddSpan(vmem* Arena, usize BaseAddress, usize Size)
+{
+    b32 Result = false;
+
+    vmem_segment* Span = 0;
+    vmem_segment* Free = 0;
+
+    if ((BaseAddress | Size) & (Arena->Quantum - 1))
+    {
+        SerialErrorf(Str("Misaligned span at 0x%p (%usize bytes) for arena '%str'."), BaseAddress, Size, Arena->Name);
+    }
+    else if (!Size || (BaseAddress + Size < BaseAddress))
+    {
+        SerialErrorf(Str("Invalid span at 0x%p (%usize bytes) for arena '%str'."), BaseAddress, Size, Arena->Name);
+    }
+    else
+    {
+        Span = VMemNewSegment();
+        Free = VMemNewSegment();
+    }
+
+    if (Span && Free)
+    {
+        b32 Enabled = VMemLock(Arena);
+
+        // NOTE(vak): Keep the spans in address order, each marker is
+        // followed by the segments of its span.
+
+        vmem_segment* After   = &Arena->Segments;
+        b32           Overlap = false;
+
+        for (vmem_segment* Segment = Arena->Segments.Next; Segment != &Arena->Segments; Segment = Segment->Next)
+        {
+            if (Segment->Kind != VMemSegmentKind_Span)
+                continue;
+
+            if ((BaseAddress - Segment->BaseAddress < Segment->Size) || (Segment->BaseAddress - BaseAddress < Size))
+            {
+                Overlap = true;
+                break;
+            }
+
+            if (Segment->BaseAddress > BaseAddress)
+                break;
+
+            After = Segment;
+            while ((After->Next != &Arena->Segments) && (After->Next->Kind != VMemSegmentKind_Span))
+                After = After->Next;
+        }
+
+        if (!Overlap)
+        {
+            Span->Kind        = VMemSegmentKind_Span;
+            Span->BaseAddress = BaseAddress;
+            Span->Size        = Size;
+
+            Free->BaseAddress = BaseAddress;
+            Free->Size        = Size;
+
+            VMemInsertAfter(After, Span);
+            VMemInsertAfter(Span, Free);
+            VMemPushFree(Arena, Free);
+
+            Arena->TotalSize += Size;
+
+            Span = 0;
+            Free = 0;
+
+            Result = true;
+        }
+
+        VMemUnlock(Arena, Enabled);
+
+        if (Overlap)
+        {
+            SerialErrorf(Str("Span at 0x%p (%usize bytes) overlaps another in arena '%str'."), BaseAddress, Size, Arena->Name);
+        }
+    }
+
+    VMemReleaseSegment(Span);
+    VMemReleaseSegment(Free);
+
+    return (Result);
+}
+
+// NOTE(vak): Searches the free lists from First to Last for a segment
+// that fits an aligned range. Instant fit takes the first one, best fit
+// the smallest one of the first list that has any.
+
+local vmem_segment* VMemSearch(
+    vmem*  Arena,
+    usize  First,
+    usize  Last,
+    usize  Size,
+    usize  Alignment,
+    b32    BestFit,
+    usize* Start
+)
+{
+    vmem_segment* Result = 0;
+
+    u64 Mask = Arena->FreeMap & ~(((u64)(1) << First) - 1);
+
+    while (Mask && !Result)
+    {
+        usize Index = __builtin_ctzll(Mask);
+        Mask &= Mask - 1;
+
+        if (Index > Last)
+            break;
+
+        for (vmem_segment* Segment = Arena->FreeLists[Index]; Segment; Segment = Segment->ListNext)
+        {
+            usize Aligned = Align(Segment->BaseAddress, Alignment);
+            usize Padding = Aligned - Segment->BaseAddress;
+
+            b32 Fits = (
+                (Aligned >= Segment->BaseAddress) &&
+                (Padding <= Segment->Size) &&
+                (Segment->Size - Padding >= Size)
+            );
+
+            if (Fits && (!Result || (Segment->Size < Result->Size)))
+            {
+                Result = Segment;
+                *Start = Aligned;
+
+                if (!BestFit)
+                    break;
+            }
+        }
+    }
+
+    return (Result);
+}
+
+// NOTE(vak): Splitting a segment can take up to two new ones, which are
+// allocated up front, since the arena lock is held.
+
+local usize VMemAllocateLocked(
+    vmem*          Arena,
+    usize          Size,
+    usize          Alignment,
+    vmem_flags     Flags,
+    vmem_segment** Spares
+)
+{
+    usize Result = 0;
+
+    b32   BestFit = (Flags & VMemFlag_BestFit) != 0;
+    usize Lowest  = VMemGetListIndex(Size);
+    usize First   = Lowest;
+    usize Start   = 0;
+
+    // NOTE(vak): For instant fit, start at the first list where every
+    // segment is large enough, and only look at the list below if that
+    // fails.
+
+    if (!BestFit && (Size & (Size - 1)))
+        First++;
+
+    vmem_segment* Segment = VMemSearch(Arena, First, VMemFreeListCount - 1, Size, Alignment, BestFit, &Start);
+
+    if (!Segment && (First != Lowest))
+        Segment = VMemSearch(Arena, Lowest, Lowest, Size, Alignment, BestFit, &Start);
+
+    if (Segment)
+    {
+        VMemRemoveFree(Arena, Segment);
+
+        if (Start > Segment->BaseAddress)
+        {
+            vmem_segment* Lead = Spares[0];
+            Spares[0] = 0;
+
+            Lead->BaseAddress = Segment->BaseAddress;
+            Lead->Size        = Start - Segment->BaseAddress;
+
+            VMemInsertAfter(Segment->Prev, Lead);
+            VMemPushFree(Arena, Lead);
+
+            Segment->BaseAddress  = Start;
+            Segment->Size        -= Lead->Size;
+        }
+
+        if (Segment->Size > Size)
+        {
+            vmem_segment* Trail = Spares[1];
+            Spares[1] = 0;
+
+            Trail->BaseAddress = Start + Size;
+            Trail->Size        = Segment->Size - Size;
+
+            VMemInsertAfter(Segment, Trail);
+            VMemPushFree(Arena, Trail);
+
+            Segment->Size = Size;
+        }
+
+        Segment->Kind = VMemSegmentKind_Allocated;
+        VMemPushList(Arena->Hash + VMemGetHashIndex(Arena, Start), Segment);
+
+        Arena->UsedSize += Size;
+        Result = Start;
+    }
+
+    return (Result);
+}
+
+// NOTE(vak): Coalesces the freed segment with its free neighbours, the
+// segments that are no longer needed are handed back in Released.
+
+local b32 VMemFreeLocked(
+    vmem*          Arena,
+    usize          Address,
+    usize          Size,
+    vmem_segment** Released
+)
+{
+    b32 Result = false;
+
+    vmem_segment** Bucket  = Arena->Hash + VMemGetHashIndex(Arena, Address);
+    vmem_segment*  Segment = *Bucket;
+
+    while (Segment && (Segment->BaseAddress != Address))
+        Segment = Segment->ListNext;
+
+    if (Segment && (Segment->Size == Size))
+    {
+        VMemRemoveList(Bucket, Segment);
+        Arena->UsedSize -= Size;
+
+        // NOTE(vak): Span markers are never free, so segments of
+        // different spans don't coalesce.
+
+        vmem_segment* Next = Segment->Next;
+        vmem_segment* Prev = Segment->Prev;
+
+        if (Next->Kind == VMemSegmentKind_Free)
+        {
+            VMemRemoveFree(Arena, Next);
+            VMemUnlink(Next);
+
+            Segment->Size += Next->Size;
+            Released[0] = Next;
+        }
+
+        if (Prev->Kind == VMemSegmentKind_Free)
+        {
+            VMemRemoveFree(Arena, Prev);
+            VMemUnlink(Segment);
+
+            Prev->Size += Segment->Size;
+            Released[1] = Segment;
+
+            Segment = Prev;
+        }
+
+        VMemPushFree(Arena, Segment);
+        Result = true;
+    }
+
+    return (Result);
+}
+
+local usize VMemAllocateSegment(vmem* Arena, usize Size, usize Alignment, vmem_flags Flags)
+{
+    usize Result = 0;
+
+    vmem_segment* Spares[2] = {VMemNewSegment(), VMemNewSegment()};
+
+    if (Spares[0] && Spares[1])
+    {
+        b32 Enabled = VMemLock(Arena);
+        Result = VMemAllocateLocked(Arena, Size, Alignment, Flags, Spares);
+        VMemUnlock(Arena, Enabled);
+    }
+
+    VMemReleaseSegment(Spares[0]);
+    VMemReleaseSegment(Spares[1]);
+
+    return (Result);
+}
+
+local void VMemFreeSegment(vmem* Arena, usize Address, usize Size)
+{
+    vmem_segment* Released[2] = {0};
+
+    b32 Enabled = VMemLock(Arena);
+    b32 Found   = VMemFreeLocked(Arena, Address, Size, Released);
+    VMemUnlock(Arena, Enabled);
+
+    if (!Found)
+    {
+        SerialErrorf(Str("Invalid free of 0x%p (%usize bytes) in arena '%str'."), Address, Size, Arena->Name);
+    }
+
+    VMemReleaseSegment(Released[0]);
+    VMemReleaseSegment(Released[1]);
+}
+
+// NOTE(vak): Quantum caches hold ranges that are allocated as far as the
+// arena is concerned. An empty cache is refilled with half of its depth,
+// a full one flushes half of its ranges back.
+
+local usize VMemQCacheAllocate(vmem* Arena, usize Size)
+{
+    usize Result = 0;
+
+    vmem_qcache* Cache = Arena->QCaches + (Size / Arena->Quantum - 1);
+
+    b32 Enabled = ArchDisableInterrupts();
+    AcquireLock(&Cache->Lock);
+
+    if (!Cache->Count)
+    {
+        for (usize Index = 0; Index < VMemQCacheDepth / 2; Index++)
+        {
+            usize Address = VMemAllocateSegment(Arena, Size, Arena->Quantum, VMemFlag_InstantFit);
+            if (!Address)
+                break;
+
+            Cache->Ranges[Cache->Count++] = Address;
+        }
+    }
+
+    if (Cache->Count)
+        Result = Cache->Ranges[--Cache->Count];
+
+    ReleaseLock(&Cache->Lock);
+    ArchRestoreInterrupts(Enabled);
+
+    return (Result);
+}
+
+local void VMemQCacheFree(vmem* Arena, usize Address, usize Size)
+{
+    vmem_qcache* Cache = Arena->QCaches + (Size / Arena->Quantum - 1);
+
+    b32 Enabled = ArchDisableInterrupts();
+    AcquireLock(&Cache->Lock);
+
+    if (Cache->Count == VMemQCacheDepth)
+    {
+        for (usize Index = 0; Index < VMemQCacheDepth / 2; Index++)
+            VMemFreeSegment(Arena, Cache->Ranges[--Cache->Count], Size);
+    }
+
+    Cache->Ranges[Cache->Count++] = Address;
+
+    ReleaseLock(&Cache->Lock);
+    ArchRestoreInterrupts(Enabled);
+}
+
+local usize VMemAllocate(vmem* Arena, usize Size, vmem_flags Flags)
+{
+    usize Result = VMemAllocateAligned(Arena, Size, 0, Flags);
+    return (Result);
+}
+
+local usize VMemAllocateAligned(vmem* Arena, usize Size, usize Alignment, vmem_flags Flags)
+{
+    usize Result = 0;
+
+    Size      = Align(Size, Arena->Quantum);
+    Alignment = Maximum(Alignment, Arena->Quantum);
+
+    if (!Size || (Alignment & (Alignment - 1)))
+    {
+        SerialErrorf(Str("Invalid allocation of %usize bytes (alignment %usize) in arena '%str'."), Size, Alignment, Arena->Name);
+    }
+    else if ((Size <= Arena->QCacheMax) && (Alignment == Arena->Quantum))
+    {
+        Result = VMemQCacheAllocate(Arena, Size);
+    }
+    else
+    {
+        Result = VMemAllocateSegment(Arena, Size, Alignment, Flags);
+    }
+
+    if (Size && !Result)
+    {
+        SerialErrorf(Str("Arena '%str' is out of space for %usize bytes."), Arena->Name, Size);
+    }
+
+    return (Result);
+}
+
+local void VMemFree(vmem* Arena, usize Address, usize Size)
+{
+    Size = Align(Size, Arena->Quantum);
+
+    if (!Address || !Size)
+    {
+        // NOTE(vak): Freeing nothing is fine.
+    }
+    else if (Size <= Arena->QCacheMax)
+    {
+        VMemQCacheFree(Arena, Address, Size);
+    }
+    else
+    {
+        VMemFreeSegment(Arena, Address, Size);
+    }
+}
+
+local void SetupKernelArena(void)
+{
+    usize PageSize = ArchGetPageSize();
+
+    VMemCreate(&KernelArena, Str("kernel"), PageSize, VMemQCacheCount * PageSize);
+
+    if (VMemAddSpan(&KernelArena, ArchGetKernelArenaBase(), ArchGetKernelArenaSize()))
+    {
+        SerialInfof(Str("Kernel arena: %usize GB at 0x%p."), ArchGetKernelArenaSize() >> 30, ArchGetKernelArenaBase());
+    }
+}
+
+local vmem* GetKernelArena(void)
+{
+    return (&KernelArena);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+// NOTE(vak): Address space arenas (vmem)
+//
+// An arena hands out ranges of some resource, here kernel virtual
+// address space, in multiples of its quantum. Every range the arena
+// knows about is a segment, a boundary tag kept on a list ordered by
+// address. Free segments are also kept on power of 2 free lists, so
+// that segments of list N are at least 2^N bytes, and a bitmap tells
+// which lists aren't empty. Allocated segments are found again by
+// address through a hash table, so freeing a range only needs the
+// neighbouring tags to coalesce with.
+//
+// Instant fit takes the first segment of the smallest list whose
+// segments are all large enough, which is O(1). Best fit searches for
+// the smallest segment that fits, which fragments less but has to walk
+// a list. Small sizes, up to QCacheMax quanta, are served by quantum
+// caches, stacks of ranges of one size that avoid the segment lists
+// entirely for the common case.
+//
+// Spans are added with VMemAddSpan, and never coalesce with each other.
+// Ranges aren't backed by memory, which is up to the caller: map device
+// memory into them, or reserve virtual regions over them, leaving an
+// unmapped page as a guard below a stack.
+
+#define VMemFreeListCount (64)
+#define VMemHashBits      (8)
+#define VMemQCacheCount   (8)  // NOTE(vak): Most quantum caches an arena can have
+#define VMemQCacheDepth   (32)
+
+typedef usize vmem_flags;
+enum
+{
+    VMemFlag_InstantFit = 0,
+    VMemFlag_BestFit    = (1 << 0),
+};
+
+typedef usize vmem_segment_kind;
+enum
+{
+    VMemSegmentKind_Span = 0, // NOTE(vak): Marks the start of a span, covers no addresses itself
+    VMemSegmentKind_Free,
+    VMemSegmentKind_Allocated,
+};
+
+typedef struct vmem_segment vmem_segment;
+struct vmem_segment
+{
+    usize             BaseAddress;
+    usize             Size;
+    vmem_segment_kind Kind;
+
+    vmem_segment*     Prev;     // NOTE(vak): All segments, by address
+    vmem_segment*     Next;
+
+    vmem_segment*     ListPrev; // NOTE(vak): Free list, or hash chain if allocated
+    vmem_segment*     ListNext;
+};
+
+typedef struct
+{
+    spin_lock Lock;
+    usize     Count;
+    usize     Ranges[VMemQCacheDepth];
+} vmem_qcache;
+
+typedef struct
+{
+    string        Name;
+    usize         Quantum;
+    usize         QCacheMax;   // NOTE(vak): Largest size served by the quantum caches
+
+    spin_lock     Lock;
+    vmem_segment  Segments;    // NOTE(vak): Sentinel of the address ordered list
+
+    u64           FreeMap;
+    vmem_segment* FreeLists[VMemFreeListCount];
+    vmem_segment* Hash[1 << VMemHashBits];
+
+    usize         TotalSize;
+    usize         UsedSize;    // NOTE(vak): Including the quantum caches
+
+    vmem_qcache   QCaches[VMemQCacheCount];
+} vmem;
+
+// NOTE(vak): Quantum has to be a power of 2. QCacheMax is rounded down
+// to a multiple of it, 0 disables the quantum caches.
+
+local void VMemCreate(vmem* Arena, string Name, usize Quantum, usize QCacheMax);
+local b32  VMemAddSpan(vmem* Arena, usize BaseAddress, usize Size);
+
+// NOTE(vak): Returns 0 if there is no range left that fits. Alignment
+// has to be a power of 2, or 0 for the quantum.
+
+local usize VMemAllocate(vmem* Arena, usize Size, vmem_flags Flags);
+local usize VMemAllocateAligned(vmem* Arena, usize Size, usize Alignment, vmem_flags Flags);
+local void  VMemFree(vmem* Arena, usize Address, usize Size);
+
+// NOTE(vak): Kernel virtual address space outside the direct map.
+
+local void  SetupKernelArena(void);
+local vmem* GetKernelArena(void);